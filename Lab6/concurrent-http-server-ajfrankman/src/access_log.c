@@ -0,0 +1,351 @@
+#include "access_log.h"
+#include "log.h"
+#include "metrics.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Formatted lines are collected here and written together.
+#define WRITE_BUFFER_SIZE (64 * 1024)
+// Longer methods are cut short in the log.
+#define MAX_METHOD 12
+// Room for one formatted line: every method and path byte may be escaped to four.
+#define MAX_LINE ((MAX_METHOD + ACCESS_LOG_MAX_PATH) * 4 + 256)
+
+typedef struct AccessLogRecord {
+    time_t time;
+    AccessLogClient client;
+    int status;
+    uint64_t bytes;
+    uint64_t duration_ns;
+    char method[MAX_METHOD];
+    char path[ACCESS_LOG_MAX_PATH];
+    unsigned char method_length;
+    unsigned char path_length;
+} AccessLogRecord;
+
+// A single-producer, single-consumer ring: only its thread writes records and moves tail, only
+// the writer reads them and moves head. Both count up forever and are masked into the array.
+// head and tail sit on separate cache lines so the two sides only share a line when one
+// actually has to look at the other's progress.
+typedef struct AccessLogRing {
+    AccessLogRecord records[ACCESS_LOG_RING_SIZE];
+    uint64_t tail __attribute__((aligned(64)));
+    uint64_t head_seen; // The producer's last look at head, so it rereads it only when full.
+    uint64_t head __attribute__((aligned(64)));
+    struct AccessLogRing *next; // In the list of every ring, which only ever grows.
+} AccessLogRing;
+
+static struct {
+    bool enabled;
+    int fd;
+    AccessLogRing *rings;
+    pthread_t writer;
+    volatile bool writing;
+} A = {.fd = -1};
+
+static __thread AccessLogRing *localRing = NULL;
+
+/*
+Description:
+    Find the calling thread's ring, creating it and adding it to the list on first use.
+Arguments:
+    None
+Return value:
+    Returns the ring, or NULL if it could not be allocated.
+*/
+static AccessLogRing *ring(void) {
+    if (localRing == NULL) {
+        AccessLogRing *ring = calloc(1, sizeof(AccessLogRing));
+        if (ring == NULL) {
+            return NULL;
+        }
+        ring->next = __atomic_load_n(&A.rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&A.rings, &ring->next, ring, true, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) {
+        }
+        localRing = ring;
+    }
+    return localRing;
+}
+
+/*
+Description:
+    Copy bytes the client sent into a log line, escaping anything that could break the line up
+    or its quoting as \xNN.
+Arguments:
+    char *out: Where the bytes go, with room for four times length.
+    const char *data: The bytes.
+    size_t length: How many there are.
+Return value:
+    Returns the number of bytes written.
+*/
+static size_t escape(char *out, const char *data, size_t length) {
+    size_t written = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = data[i];
+        if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\') {
+            written += sprintf(out + written, "\\x%02x", c);
+        } else {
+            out[written++] = c;
+        }
+    }
+    return written;
+}
+
+/*
+Description:
+    Format an entry as one line of the log, in the Common Log Format with the request line cut
+    down to the method and path, and the duration in seconds added at the end.
+Arguments:
+    char *out: Where the line goes, with room for MAX_LINE bytes.
+    const AccessLogRecord *record: The entry.
+    const char *date: The entry's time, formatted.
+Return value:
+    Returns the length of the line.
+*/
+static size_t format_record(char *out, const AccessLogRecord *record, const char *date) {
+    char client[INET6_ADDRSTRLEN] = "-";
+    size_t length;
+
+    if (record->client.family != AF_UNSPEC) {
+        inet_ntop(record->client.family, record->client.address, client, sizeof client);
+    }
+    length = sprintf(out, "%s - - [%s] \"", client, date);
+    if (record->method_length == 0) {
+        out[length++] = '-';
+    } else {
+        length += escape(out + length, record->method, record->method_length);
+        out[length++] = ' ';
+        length += escape(out + length, record->path, record->path_length);
+    }
+    length += sprintf(out + length, "\" %d %llu %.6f\n", record->status,
+                      (unsigned long long)record->bytes, record->duration_ns / 1e9);
+    return length;
+}
+
+/*
+Description:
+    Take everything waiting in every ring and write it out.
+Arguments:
+    char *buffer: WRITE_BUFFER_SIZE bytes of scratch space.
+Return value:
+    Returns the number of entries written.
+*/
+static size_t drain(char *buffer) {
+    // Formatting the date is the slow part of a line, and it only changes once a second.
+    static time_t dateTime = (time_t)-1;
+    static char date[64];
+    size_t used = 0;
+    size_t count = 0;
+
+    for (AccessLogRing *ring = __atomic_load_n(&A.rings, __ATOMIC_ACQUIRE); ring != NULL;
+         ring = ring->next) {
+        uint64_t head = ring->head;
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const AccessLogRecord *record = &ring->records[head & (ACCESS_LOG_RING_SIZE - 1)];
+            if (record->time != dateTime) {
+                struct tm tm;
+                dateTime = record->time;
+                strftime(date, sizeof date, "%d/%b/%Y:%H:%M:%S %z", localtime_r(&dateTime, &tm));
+            }
+            if (used + MAX_LINE > WRITE_BUFFER_SIZE) {
+                if (write(A.fd, buffer, used) == -1) {
+                    log_error("Could not write the access log: %s", strerror(errno));
+                }
+                used = 0;
+            }
+            used += format_record(buffer + used, record, date);
+            count++;
+        }
+        // Only now may the producer reuse the slots.
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+    if (used > 0 && write(A.fd, buffer, used) == -1) {
+        log_error("Could not write the access log: %s", strerror(errno));
+    }
+    return count;
+}
+
+static void *writer_thread(void *arg) {
+    char *buffer = (char *)arg;
+    struct timespec pause = {0, ACCESS_LOG_FLUSH_MS * 1000000L};
+
+    while (A.writing) {
+        if (drain(buffer) == 0) {
+            nanosleep(&pause, NULL);
+        }
+    }
+    // Whatever was logged before access_log_close was called.
+    drain(buffer);
+    free(buffer);
+    return NULL;
+}
+
+/*
+Description:
+    Open the access log and start the thread that writes it. Each request thread hands its
+    entries to the writer through a ring of its own, so logging never takes a lock or waits on
+    the file; an entry that finds its ring full is dropped and counted in the metrics instead.
+Arguments:
+    const char *path: The file to append to.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+int access_log_open(const char *path) {
+    char *buffer = malloc(WRITE_BUFFER_SIZE);
+    if (buffer == NULL) {
+        return 1;
+    }
+    A.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (A.fd == -1) {
+        log_error("Could not open the access log %s: %s", path, strerror(errno));
+        free(buffer);
+        return 1;
+    }
+    A.writing = true;
+    if (pthread_create(&A.writer, NULL, writer_thread, buffer) != 0) {
+        log_error("Could not start the access log writer.");
+        close(A.fd);
+        A.fd = -1;
+        free(buffer);
+        return 1;
+    }
+    A.enabled = true;
+    return 0;
+}
+
+/*
+Description:
+    Check whether access_log_open has been called, so callers can skip gathering what an entry
+    needs when there is no log.
+Arguments:
+    None
+Return value:
+    Returns true if entries are being logged.
+*/
+bool access_log_enabled(void) {
+    return A.enabled;
+}
+
+/*
+Description:
+    Look up the address of the client on a socket.
+Arguments:
+    int socket: The client socket.
+    AccessLogClient *client: Set to its address, or to AF_UNSPEC if it has none.
+Return value:
+    None
+*/
+void access_log_client(int socket, AccessLogClient *client) {
+    struct sockaddr_storage address;
+    socklen_t length = sizeof address;
+
+    client->family = AF_UNSPEC;
+    if (getpeername(socket, (struct sockaddr *)&address, &length) == -1) {
+        return;
+    }
+    if (address.ss_family == AF_INET) {
+        client->family = AF_INET;
+        memcpy(client->address, &((struct sockaddr_in *)&address)->sin_addr,
+               sizeof(struct in_addr));
+    } else if (address.ss_family == AF_INET6) {
+        client->family = AF_INET6;
+        memcpy(client->address, &((struct sockaddr_in6 *)&address)->sin6_addr,
+               sizeof(struct in6_addr));
+    }
+}
+
+/*
+Description:
+    Log one request from the calling thread. Only copies the entry into the thread's ring; the
+    writer thread formats it.
+Arguments:
+    const AccessLogClient *client: Who sent the request.
+    const char *method: The request method, not NUL-terminated. NULL if it was never parsed.
+    size_t method_length: The length of method.
+    const char *path: The request path, not NUL-terminated. NULL if it was never parsed.
+    size_t path_length: The length of path.
+    int status: The status code of the response.
+    uint64_t bytes: The bytes of the response sent, head and body.
+    uint64_t duration_ns: From the first byte of the request to the last byte of the response.
+Return value:
+    None
+*/
+void access_log_write(const AccessLogClient *client, const char *method, size_t method_length,
+                      const char *path, size_t path_length, int status, uint64_t bytes,
+                      uint64_t duration_ns) {
+    AccessLogRing *local = ring();
+    if (local == NULL) {
+        metrics_add(METRIC_ACCESS_LOG_DROPPED, 1);
+        return;
+    }
+
+    uint64_t tail = local->tail;
+    if (tail - local->head_seen == ACCESS_LOG_RING_SIZE) {
+        local->head_seen = __atomic_load_n(&local->head, __ATOMIC_ACQUIRE);
+        if (tail - local->head_seen == ACCESS_LOG_RING_SIZE) {
+            // The writer is behind. Losing the entry beats making the request wait for the disk.
+            metrics_add(METRIC_ACCESS_LOG_DROPPED, 1);
+            return;
+        }
+    }
+
+    AccessLogRecord *record = &local->records[tail & (ACCESS_LOG_RING_SIZE - 1)];
+    record->time = time(NULL);
+    record->client = *client;
+    record->status = status;
+    record->bytes = bytes;
+    record->duration_ns = duration_ns;
+    record->method_length = 0;
+    record->path_length = 0;
+    if (method != NULL) {
+        record->method_length =
+            method_length < sizeof record->method ? method_length : sizeof record->method;
+        memcpy(record->method, method, record->method_length);
+    }
+    if (path != NULL) {
+        record->path_length = path_length < ACCESS_LOG_MAX_PATH ? path_length : ACCESS_LOG_MAX_PATH;
+        memcpy(record->path, path, record->path_length);
+    }
+    // Publishes the record: the writer reads nothing past tail.
+    __atomic_store_n(&local->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+Description:
+    Write out every entry still waiting, stop the writer thread and close the log. Call it once
+    no thread will log again.
+Arguments:
+    None
+Return value:
+    None
+*/
+void access_log_close(void) {
+    if (!A.enabled) {
+        return;
+    }
+    A.enabled = false;
+    A.writing = false;
+    pthread_join(A.writer, NULL);
+    close(A.fd);
+    A.fd = -1;
+
+    AccessLogRing *ring = A.rings;
+    while (ring != NULL) {
+        AccessLogRing *next = ring->next;
+        free(ring);
+        ring = next;
+    }
+    A.rings = NULL;
+}
@@ -0,0 +1,87 @@
+#ifndef ACCESS_LOG_H_
+#define ACCESS_LOG_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Records a thread can have waiting for the writer before it starts dropping them. A power of two.
+#define ACCESS_LOG_RING_SIZE 2048
+// How long the writer sleeps when every ring is empty, so writes are batched.
+#define ACCESS_LOG_FLUSH_MS 5
+// Longer request paths are cut short in the log.
+#define ACCESS_LOG_MAX_PATH 192
+
+// A client address, kept raw so turning it into text is left to the writer thread.
+typedef struct AccessLogClient {
+    sa_family_t family; // AF_INET, AF_INET6, or AF_UNSPEC when it is not known.
+    unsigned char address[16];
+} AccessLogClient;
+
+/*
+Description:
+    Open the access log and start the thread that writes it. Each request thread hands its
+    entries to the writer through a ring of its own, so logging never takes a lock or waits on
+    the file; an entry that finds its ring full is dropped and counted in the metrics instead.
+Arguments:
+    const char *path: The file to append to.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+int access_log_open(const char *path);
+
+/*
+Description:
+    Check whether access_log_open has been called, so callers can skip gathering what an entry
+    needs when there is no log.
+Arguments:
+    None
+Return value:
+    Returns true if entries are being logged.
+*/
+bool access_log_enabled(void);
+
+/*
+Description:
+    Look up the address of the client on a socket.
+Arguments:
+    int socket: The client socket.
+    AccessLogClient *client: Set to its address, or to AF_UNSPEC if it has none.
+Return value:
+    None
+*/
+void access_log_client(int socket, AccessLogClient *client);
+
+/*
+Description:
+    Log one request from the calling thread. Only copies the entry into the thread's ring; the
+    writer thread formats it.
+Arguments:
+    const AccessLogClient *client: Who sent the request.
+    const char *method: The request method, not NUL-terminated. NULL if it was never parsed.
+    size_t method_length: The length of method.
+    const char *path: The request path, not NUL-terminated. NULL if it was never parsed.
+    size_t path_length: The length of path.
+    int status: The status code of the response.
+    uint64_t bytes: The bytes of the response sent, head and body.
+    uint64_t duration_ns: From the first byte of the request to the last byte of the response.
+Return value:
+    None
+*/
+void access_log_write(const AccessLogClient *client, const char *method, size_t method_length,
+                      const char *path, size_t path_length, int status, uint64_t bytes,
+                      uint64_t duration_ns);
+
+/*
+Description:
+    Write out every entry still waiting, stop the writer thread and close the log. Call it once
+    no thread will log again.
+Arguments:
+    None
+Return value:
+    None
+*/
+void access_log_close(void);
+
+#endif
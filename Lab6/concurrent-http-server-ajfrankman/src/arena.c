@@ -0,0 +1,132 @@
+#include "arena.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct {
+    Arena *free;
+    int num_free;
+    pthread_mutex_t lock;
+} P = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static ArenaBlock *new_block(size_t size) {
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + size);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+static void free_arena(Arena *arena) {
+    ArenaBlock *block = arena->head;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(arena);
+}
+
+Arena *arena_acquire(void) {
+    pthread_mutex_lock(&P.lock);
+    Arena *arena = P.free;
+    if (arena != NULL) {
+        P.free = arena->next_free;
+        P.num_free--;
+    }
+    pthread_mutex_unlock(&P.lock);
+    if (arena != NULL) {
+        arena->next_free = NULL;
+        return arena;
+    }
+
+    if ((arena = calloc(1, sizeof(Arena))) == NULL) {
+        return NULL;
+    }
+    if ((arena->head = new_block(ARENA_BLOCK_SIZE)) == NULL) {
+        free(arena);
+        return NULL;
+    }
+    arena->current = arena->head;
+    return arena;
+}
+
+void arena_release(Arena *arena) {
+    if (arena == NULL) {
+        return;
+    }
+
+    ArenaBlock *block = arena->head->next;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head->next = NULL;
+    arena_reset(arena);
+
+    pthread_mutex_lock(&P.lock);
+    if (P.num_free < ARENA_POOL_MAX) {
+        arena->next_free = P.free;
+        P.free = arena;
+        P.num_free++;
+        arena = NULL;
+    }
+    pthread_mutex_unlock(&P.lock);
+    if (arena != NULL) {
+        free_arena(arena);
+    }
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+    while (true) {
+        ArenaBlock *block = arena->current;
+        if (block->size - block->used >= size) {
+            void *memory = block->data + block->used;
+            block->used += size;
+            return memory;
+        }
+        // Move on to a block kept from an earlier request before growing the chain.
+        if (block->next == NULL) {
+            block->next = new_block(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+            if (block->next == NULL) {
+                return NULL;
+            }
+        }
+        arena->current = block->next;
+        arena->current->used = 0;
+    }
+}
+
+char *arena_strdup(Arena *arena, const char *string) {
+    size_t length = strlen(string) + 1;
+    char *copy = arena_alloc(arena, length);
+    if (copy != NULL) {
+        memcpy(copy, string, length);
+    }
+    return copy;
+}
+
+void arena_reset(Arena *arena) {
+    // Later blocks are cleared as arena_alloc reaches them.
+    arena->current = arena->head;
+    arena->head->used = 0;
+}
+
+void arena_pool_shutdown(void) {
+    pthread_mutex_lock(&P.lock);
+    while (P.free != NULL) {
+        Arena *next = P.free->next_free;
+        free_arena(P.free);
+        P.free = next;
+    }
+    P.num_free = 0;
+    pthread_mutex_unlock(&P.lock);
+}
@@ -0,0 +1,91 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_ALIGNMENT 16
+// Idle arenas kept for reuse by new connections; any beyond this are freed.
+#define ARENA_POOL_MAX 1024
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+// A region allocator for everything that lives as long as one request. Allocations are bumped
+// out of a chain of blocks and are never freed individually; arena_reset gives all of them back
+// at once. Blocks stay chained across resets so a connection stops calling malloc once its
+// arena has grown to fit its largest response.
+typedef struct Arena {
+    ArenaBlock *head;
+    ArenaBlock *current;
+    struct Arena *next_free; // Link in the pool of idle arenas.
+} Arena;
+
+/*
+Description:
+    Take an empty arena from the shared pool, or allocate a new one if the pool is empty.
+Arguments:
+    None
+Return value:
+    Returns the arena, or NULL if it could not be allocated.
+*/
+Arena *arena_acquire(void);
+
+/*
+Description:
+    Reset an arena and return it to the shared pool. Blocks beyond the first are freed so pooled
+    arenas do not hold on to the memory of one unusually large response.
+Arguments:
+    Arena *arena: The arena to release. May be NULL.
+Return value:
+    None
+*/
+void arena_release(Arena *arena);
+
+/*
+Description:
+    Allocate memory from an arena, aligned to ARENA_ALIGNMENT.
+Arguments:
+    Arena *arena: The arena to allocate from.
+    size_t size: The number of bytes to allocate.
+Return value:
+    Returns the memory, or NULL if a new block could not be allocated.
+*/
+void *arena_alloc(Arena *arena, size_t size);
+
+/*
+Description:
+    Copy a string into an arena.
+Arguments:
+    Arena *arena: The arena to allocate from.
+    const char *string: The NUL-terminated string to copy.
+Return value:
+    Returns the copy, or NULL if it could not be allocated.
+*/
+char *arena_strdup(Arena *arena, const char *string);
+
+/*
+Description:
+    Free every allocation made from an arena in O(1). The blocks are kept for reuse.
+Arguments:
+    Arena *arena: The arena to reset.
+Return value:
+    None
+*/
+void arena_reset(Arena *arena);
+
+/*
+Description:
+    Free every idle arena in the shared pool. Arenas still held by connections are not touched.
+Arguments:
+    None
+Return value:
+    None
+*/
+void arena_pool_shutdown(void);
+
+#endif
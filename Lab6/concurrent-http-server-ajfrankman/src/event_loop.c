@@ -0,0 +1,353 @@
+#define _GNU_SOURCE
+
+#include "event_loop.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+
+typedef struct EventLoop {
+    pthread_t thread;
+    int index;
+    int epoll_fd;
+    int listen_socket;
+    bool owns_listener; // MODE_REUSEPORT: the listener is this loop's own shard.
+    Config *config;
+    volatile bool *running;
+    Connection *connections; // Every open connection, so they can be freed on shutdown.
+    TimerWheel wheel;        // The deadline of every open connection.
+} EventLoop;
+
+/*
+Description:
+    Unlink a connection from its loop and free it. Closing the socket also removes it from the
+    epoll set.
+Arguments:
+    EventLoop *loop: The loop that owns the connection.
+    Connection *conn: The connection to close.
+Return value:
+    None
+*/
+static void close_connection(EventLoop *loop, Connection *conn) {
+    timer_wheel_cancel(&conn->timer);
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        loop->connections = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    http_server_connection_destroy(conn);
+}
+
+/*
+Description:
+    Move a connection's timer to its current deadline.
+Arguments:
+    EventLoop *loop: The loop that owns the connection.
+    Connection *conn: The connection that made progress.
+Return value:
+    None
+*/
+static void arm_timer(EventLoop *loop, Connection *conn) {
+    uint64_t now = timer_wheel_now_ms();
+    timer_wheel_schedule(&loop->wheel, &conn->timer,
+                         http_server_connection_deadline(conn, *loop->config, now));
+}
+
+/*
+Description:
+    Accept every pending client on the listening socket and register it with this loop.
+Arguments:
+    EventLoop *loop: The loop that will own the new connections.
+Return value:
+    None
+*/
+static void accept_clients(EventLoop *loop) {
+    while (true) {
+        int clientSocket =
+            accept4(loop->listen_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientSocket == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // EAGAIN means another loop took the client or the queue is empty.
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_error("accept: %s", strerror(errno));
+            }
+            return;
+        }
+
+        Connection *conn = http_server_connection_create(clientSocket);
+        if (conn == NULL) {
+            close(clientSocket);
+            continue;
+        }
+
+        // Register for both directions once; the connection state decides which one matters.
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, clientSocket, &event) == -1) {
+            log_error("epoll_ctl: %s", strerror(errno));
+            http_server_connection_destroy(conn);
+            continue;
+        }
+
+        conn->next = loop->connections;
+        if (loop->connections != NULL) {
+            loop->connections->prev = conn;
+        }
+        loop->connections = conn;
+        arm_timer(loop, conn);
+    }
+}
+
+/*
+Description:
+    Advance a connection's state machine as far as its socket allows. Because the socket is
+    edge-triggered, every step runs until it finishes or the socket reports EAGAIN.
+Arguments:
+    EventLoop *loop: The loop that owns the connection.
+    Connection *conn: The connection that epoll reported as ready.
+Return value:
+    None
+*/
+static void drive_connection(EventLoop *loop, Connection *conn) {
+    int result;
+
+    while (true) {
+        switch (conn->state) {
+        case CONN_READING:
+            if ((result = http_server_read_request(conn)) == HTTP_SERVER_IO_AGAIN) {
+                arm_timer(loop, conn);
+                return;
+            } else if (result == HTTP_SERVER_IO_ERROR) {
+                close_connection(loop, conn);
+                return;
+            }
+            if (http_server_process_request(&conn->request, *loop->config, &conn->response) ==
+                1) {
+                log_error("Could not build Response.");
+                close_connection(loop, conn);
+                return;
+            }
+            conn->requests_served++;
+            conn->keep_alive = http_server_set_keep_alive(&conn->request, &conn->response,
+                                                          conn->requests_served, *loop->config);
+            conn->state = CONN_WRITING;
+            break;
+        case CONN_WRITING:
+            if ((result = http_server_write_response(conn)) == HTTP_SERVER_IO_AGAIN) {
+                arm_timer(loop, conn);
+                return;
+            } else if (result == HTTP_SERVER_IO_ERROR) {
+                close_connection(loop, conn);
+                return;
+            }
+            if (conn->keep_alive) {
+                http_server_connection_reset(conn);
+            } else {
+                conn->state = CONN_DONE;
+            }
+            break;
+        case CONN_DONE:
+            close_connection(loop, conn);
+            return;
+        }
+    }
+}
+
+static void expire_connection(Timer *timer, void *arg) {
+    log_info("Closing a connection that missed its deadline.");
+    close_connection((EventLoop *)arg, (Connection *)timer->data);
+}
+
+/*
+Description:
+    Make a bound socket non-blocking and start listening on it.
+Arguments:
+    int socket: The bound socket.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+static int start_listening(int socket) {
+    if (fcntl(socket, F_SETFL, fcntl(socket, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        log_error("fcntl: %s", strerror(errno));
+        return 1;
+    }
+    if (listen(socket, SOMAXCONN) == -1) {
+        log_error("listen: %s", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/*
+Description:
+    Open the listening socket a loop accepts on and register it with the loop's epoll set. In
+    MODE_REUSEPORT every loop after the first binds its own SO_REUSEPORT listener and the kernel
+    spreads new connections across them, so no two loops ever contend for the same accept
+    queue. Otherwise all loops share the one listener and EPOLLEXCLUSIVE wakes only one of them
+    per incoming client.
+Arguments:
+    EventLoop *loop: The loop to set up. Loop 0 always uses the socket main bound.
+    int socket: The socket main bound, already listening.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+static int open_listener(EventLoop *loop, int socket) {
+    struct epoll_event event;
+
+    loop->listen_socket = socket;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    if (loop->config->mode == MODE_REUSEPORT) {
+        event.events = EPOLLIN;
+        if (loop->index > 0) {
+            if ((loop->listen_socket = http_server_create(*loop->config)) == -1) {
+                return 1;
+            }
+            loop->owns_listener = true;
+            if (start_listening(loop->listen_socket) == 1) {
+                return 1;
+            }
+        }
+    }
+
+    event.data.ptr = NULL;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_socket, &event) == -1) {
+        log_error("epoll_ctl: %s", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/*
+Description:
+    Pin the calling thread to one core, so a loop and the connections it owns keep their caches
+    warm on that core.
+Arguments:
+    int index: The loop's position; it runs on core index modulo the number of cores.
+Return value:
+    None
+*/
+static void pin_to_core(int index) {
+    cpu_set_t cpus;
+    int core = index % (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+    if (error != 0) {
+        log_error("pthread_setaffinity_np: %s", strerror(error));
+    }
+}
+
+static void *event_loop_thread(void *arg) {
+    EventLoop *loop = (EventLoop *)arg;
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+    if (loop->config->pin_threads) {
+        pin_to_core(loop->index);
+    }
+
+    while (*loop->running) {
+        int numEvents = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS,
+                                   EVENT_LOOP_WAIT_MS);
+        if (numEvents == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("epoll_wait: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < numEvents; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_clients(loop);
+            } else {
+                drive_connection(loop, (Connection *)events[i].data.ptr);
+            }
+        }
+        timer_wheel_advance(&loop->wheel, timer_wheel_now_ms(), expire_connection, loop);
+    }
+
+    while (loop->connections != NULL) {
+        close_connection(loop, loop->connections);
+    }
+    close(loop->epoll_fd);
+    if (loop->owns_listener) {
+        close(loop->listen_socket);
+    }
+    return NULL;
+}
+
+/*
+Description:
+    Serve clients with config.num_threads edge-triggered epoll event loops. Every loop owns the
+    connections it accepts, driving each one through http_server_read_request,
+    http_server_process_request and http_server_write_response as the socket becomes ready. In
+    MODE_EPOLL the loops share the listening socket; in MODE_REUSEPORT each loop accepts on its
+    own SO_REUSEPORT shard of the port. *This is a blocking call.*
+Arguments:
+    int socket: The bound server socket to listen and accept on. In MODE_REUSEPORT it must have
+        been bound with SO_REUSEPORT and becomes the first loop's shard.
+    Config config: The server configuration.
+    volatile bool *running: Checked every EVENT_LOOP_WAIT_MS; the loops exit once it is false.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+int event_loop_run(int socket, Config config, volatile bool *running) {
+    int started = 0;
+
+    if (start_listening(socket) == 1) {
+        return 1;
+    }
+
+    EventLoop *loops = calloc(config.num_threads, sizeof(EventLoop));
+    if (loops == NULL) {
+        return 1;
+    }
+
+    for (int i = 0; i < config.num_threads; i++) {
+        EventLoop *loop = &loops[i];
+        loop->index = i;
+        loop->config = &config;
+        loop->running = running;
+        timer_wheel_init(&loop->wheel, timer_wheel_now_ms());
+
+        if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+            log_error("epoll_create1: %s", strerror(errno));
+            break;
+        }
+        if (open_listener(loop, socket) == 1) {
+            close(loop->epoll_fd);
+            if (loop->owns_listener) {
+                close(loop->listen_socket);
+            }
+            break;
+        }
+
+        if (pthread_create(&loop->thread, NULL, event_loop_thread, loop) != 0) {
+            log_error("Could not start event loop thread.");
+            close(loop->epoll_fd);
+            break;
+        }
+        started++;
+    }
+
+    if (started != config.num_threads) {
+        *running = false;
+    }
+    printf("server: %d event loops waiting for connections...\n", started);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(loops[i].thread, NULL);
+    }
+    free(loops);
+
+    return started == config.num_threads ? 0 : 1;
+}
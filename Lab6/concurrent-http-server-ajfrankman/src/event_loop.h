@@ -0,0 +1,28 @@
+#ifndef EVENT_LOOP_H_
+#define EVENT_LOOP_H_
+
+#include <stdbool.h>
+
+#include "http_server.h"
+
+#define EVENT_LOOP_MAX_EVENTS 256
+#define EVENT_LOOP_WAIT_MS 500
+
+/*
+Description:
+    Serve clients with config.num_threads edge-triggered epoll event loops. Every loop owns the
+    connections it accepts, driving each one through http_server_read_request,
+    http_server_process_request and http_server_write_response as the socket becomes ready. In
+    MODE_EPOLL the loops share the listening socket; in MODE_REUSEPORT each loop accepts on its
+    own SO_REUSEPORT shard of the port. *This is a blocking call.*
+Arguments:
+    int socket: The bound server socket to listen and accept on. In MODE_REUSEPORT it must have
+        been bound with SO_REUSEPORT and becomes the first loop's shard.
+    Config config: The server configuration.
+    volatile bool *running: Checked every EVENT_LOOP_WAIT_MS; the loops exit once it is false.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+int event_loop_run(int socket, Config config, volatile bool *running);
+
+#endif
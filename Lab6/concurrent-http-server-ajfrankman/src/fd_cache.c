@@ -0,0 +1,342 @@
+#include "fd_cache.h"
+#include "log.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct Stripe {
+    pthread_mutex_t lock;
+    FdEntry *lru_head; // Most recently used
+    FdEntry *lru_tail;
+    int num_files;
+} Stripe;
+
+static struct {
+    FdEntry *buckets[FD_CACHE_BUCKETS];
+    Stripe stripes[FD_CACHE_STRIPES];
+    int max_files; // Per stripe.
+    int revalidate_ms;
+} F;
+
+static unsigned long hash_path(const char *path) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *path != '\0'; path++) {
+        hash ^= (unsigned char)*path;
+        hash *= 1099511628211ULL;
+    }
+    return (unsigned long)(hash % FD_CACHE_BUCKETS);
+}
+
+static Stripe *stripe_of(unsigned long bucket) {
+    return &F.stripes[bucket % FD_CACHE_STRIPES];
+}
+
+static void free_entry(FdEntry *entry) {
+    if (entry->fd != -1) {
+        close(entry->fd);
+    }
+    free(entry->path);
+    free(entry);
+}
+
+static void lru_unlink(Stripe *stripe, FdEntry *entry) {
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        stripe->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        stripe->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push_front(Stripe *stripe, FdEntry *entry) {
+    entry->lru_next = stripe->lru_head;
+    if (stripe->lru_head != NULL) {
+        stripe->lru_head->lru_prev = entry;
+    }
+    stripe->lru_head = entry;
+    if (stripe->lru_tail == NULL) {
+        stripe->lru_tail = entry;
+    }
+}
+
+/*
+Description:
+    Take an entry out of the table. It is closed now if nobody is using it, otherwise by the last
+    fd_cache_release. Must be called with its stripe's lock held.
+Arguments:
+    FdEntry *entry: The entry to remove.
+Return value:
+    None
+*/
+static void remove_entry(FdEntry *entry) {
+    unsigned long bucket = hash_path(entry->path);
+    Stripe *stripe = stripe_of(bucket);
+    FdEntry **link = &F.buckets[bucket];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+
+    lru_unlink(stripe, entry);
+    stripe->num_files--;
+    entry->stale = true;
+    if (entry->refs == 0) {
+        free_entry(entry);
+    }
+}
+
+/*
+Description:
+    Find the entry for a path. Must be called with its stripe's lock held.
+Arguments:
+    const char *path: The path of the file.
+    unsigned long bucket: The hash bucket of path.
+Return value:
+    Returns the entry, or NULL if the path is not in the table.
+*/
+static FdEntry *find_entry(const char *path, unsigned long bucket) {
+    FdEntry *entry;
+    for (entry = F.buckets[bucket]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->path, path) == 0) {
+            break;
+        }
+    }
+    return entry;
+}
+
+/*
+Description:
+    Compare an entry with a fresh stat(2) of its path.
+Arguments:
+    const FdEntry *entry: The cached entry.
+    const struct stat *info: The result of stat(2), or NULL if it failed.
+Return value:
+    Returns true if the entry still describes the file: a negative entry while there is still no
+    regular file, an open one while the file has not been replaced or modified.
+*/
+static bool same_file(const FdEntry *entry, const struct stat *info) {
+    if (entry->fd == -1) {
+        return info == NULL || !S_ISREG(info->st_mode);
+    }
+    return info != NULL && entry->inode == info->st_ino && entry->device == info->st_dev &&
+           entry->size == info->st_size && entry->mtime == info->st_mtime;
+}
+
+/*
+Description:
+    Open a regular file into a new, unlinked entry.
+Arguments:
+    const char *path: The file to open.
+Return value:
+    Returns the entry, or NULL if the file cannot be opened or is not a regular file. errno is
+    ENOENT, ENOTDIR or EISDIR when there is nothing to serve at the path, as opposed to a
+    transient failure such as running out of descriptors.
+*/
+static FdEntry *open_file(const char *path) {
+    struct stat info;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &info) == -1 || !S_ISREG(info.st_mode)) {
+        close(fd);
+        errno = EISDIR;
+        return NULL;
+    }
+
+    FdEntry *entry = calloc(1, sizeof(FdEntry));
+    if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+        free(entry);
+        close(fd);
+        return NULL;
+    }
+    entry->fd = fd;
+    entry->size = info.st_size;
+    entry->mtime = info.st_mtime;
+    entry->inode = info.st_ino;
+    entry->device = info.st_dev;
+    entry->mime = mime_lookup(path);
+    entry->checked_ms = timer_wheel_now_ms();
+    return entry;
+}
+
+/*
+Description:
+    Make a negative entry, which remembers that there is no file at a path.
+Arguments:
+    const char *path: The path that could not be opened.
+Return value:
+    Returns the entry, or NULL if out of memory.
+*/
+static FdEntry *missing_file(const char *path) {
+    FdEntry *entry = calloc(1, sizeof(FdEntry));
+    if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+        free(entry);
+        return NULL;
+    }
+    entry->fd = -1;
+    entry->checked_ms = timer_wheel_now_ms();
+    return entry;
+}
+
+/*
+Description:
+    Put a new entry in the table, evicting the least recently used ones in its stripe to make
+    room. Must be called with its stripe's lock held.
+Arguments:
+    FdEntry *entry: The entry to add.
+    unsigned long bucket: The hash bucket of its path.
+Return value:
+    None
+*/
+static void insert_entry(FdEntry *entry, unsigned long bucket) {
+    Stripe *stripe = stripe_of(bucket);
+    while (stripe->num_files >= F.max_files && stripe->lru_tail != NULL) {
+        remove_entry(stripe->lru_tail);
+    }
+    entry->next = F.buckets[bucket];
+    F.buckets[bucket] = entry;
+    lru_push_front(stripe, entry);
+    stripe->num_files++;
+}
+
+int fd_cache_init(int max_files, int revalidate_ms) {
+    F.max_files = (max_files + FD_CACHE_STRIPES - 1) / FD_CACHE_STRIPES;
+    F.revalidate_ms = revalidate_ms;
+    for (int i = 0; i < FD_CACHE_STRIPES; i++) {
+        pthread_mutex_init(&F.stripes[i].lock, NULL);
+    }
+    return 0;
+}
+
+FdEntry *fd_cache_acquire(const char *path) {
+    unsigned long bucket = hash_path(path);
+    Stripe *stripe = stripe_of(bucket);
+    uint64_t now = timer_wheel_now_ms();
+    FdEntry *entry;
+
+    pthread_mutex_lock(&stripe->lock);
+    entry = find_entry(path, bucket);
+    if (entry != NULL && now - entry->checked_ms >= (uint64_t)F.revalidate_ms) {
+        // stat() can wait on the disk, so it runs without the lock. The reference keeps the entry
+        // alive meanwhile, and checked_ms shows whether another thread revalidated it first.
+        uint64_t checked = entry->checked_ms;
+        entry->refs++;
+        pthread_mutex_unlock(&stripe->lock);
+        struct stat info;
+        bool found = stat(path, &info) == 0;
+        pthread_mutex_lock(&stripe->lock);
+        entry->refs--;
+        if (entry->stale) {
+            // Another thread found it out of date and removed it. Use whatever replaced it.
+            if (entry->refs == 0) {
+                free_entry(entry);
+            }
+            entry = find_entry(path, bucket);
+        } else if (entry->checked_ms == checked) {
+            if (same_file(entry, found ? &info : NULL)) {
+                entry->checked_ms = now;
+            } else {
+                log_info("fd cache: %s changed on disk", path);
+                remove_entry(entry);
+                entry = NULL;
+            }
+        }
+    }
+    if (entry != NULL && entry->fd == -1) {
+        // Known to be missing.
+        pthread_mutex_unlock(&stripe->lock);
+        metrics_add(METRIC_FD_CACHE_HITS, 1);
+        return NULL;
+    }
+    if (entry != NULL) {
+        metrics_add(METRIC_FD_CACHE_HITS, 1);
+        entry->refs++;
+        lru_unlink(stripe, entry);
+        lru_push_front(stripe, entry);
+        pthread_mutex_unlock(&stripe->lock);
+        return entry;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+
+    // Miss: open the file without holding the lock.
+    metrics_add(METRIC_FD_CACHE_MISSES, 1);
+    FdEntry *opened = open_file(path);
+    if (opened == NULL) {
+        // Remember paths with nothing to serve, so requests for missing files (and probes for
+        // optional ones like precompressed variants) do not cost an open() each time.
+        if ((errno == ENOENT || errno == ENOTDIR || errno == EISDIR) && F.max_files > 0 &&
+            (opened = missing_file(path)) != NULL) {
+            pthread_mutex_lock(&stripe->lock);
+            if ((entry = find_entry(path, bucket)) == NULL) {
+                insert_entry(opened, bucket);
+            }
+            pthread_mutex_unlock(&stripe->lock);
+            if (entry != NULL) {
+                free_entry(opened);
+            }
+        }
+        return NULL;
+    }
+    opened->refs = 1;
+
+    pthread_mutex_lock(&stripe->lock);
+    entry = find_entry(path, bucket);
+    if (entry != NULL && entry->fd != -1) {
+        // Another thread opened it first.
+        entry->refs++;
+        pthread_mutex_unlock(&stripe->lock);
+        free_entry(opened);
+        return entry;
+    }
+    if (entry != NULL) {
+        // A negative entry from before the file appeared.
+        remove_entry(entry);
+    }
+    if (F.max_files == 0) {
+        opened->stale = true;
+        pthread_mutex_unlock(&stripe->lock);
+        return opened;
+    }
+    insert_entry(opened, bucket);
+    pthread_mutex_unlock(&stripe->lock);
+
+    return opened;
+}
+
+void fd_cache_release(FdEntry *entry) {
+    Stripe *stripe = stripe_of(hash_path(entry->path));
+
+    pthread_mutex_lock(&stripe->lock);
+    entry->refs--;
+    bool unused = entry->refs == 0 && entry->stale;
+    pthread_mutex_unlock(&stripe->lock);
+
+    if (unused) {
+        free_entry(entry);
+    }
+}
+
+void fd_cache_shutdown(void) {
+    for (int i = 0; i < FD_CACHE_STRIPES; i++) {
+        pthread_mutex_lock(&F.stripes[i].lock);
+        while (F.stripes[i].lru_head != NULL) {
+            remove_entry(F.stripes[i].lru_head);
+        }
+        pthread_mutex_unlock(&F.stripes[i].lock);
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef FD_CACHE_H_
+#define FD_CACHE_H_
+
+#include "mime.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define FD_CACHE_BUCKETS 1024
+// The table is split into stripes with a lock each, as in the path cache, so requests for
+// different files rarely wait on each other.
+#define FD_CACHE_STRIPES 16
+#define FD_CACHE_DEFAULT_MAX_FILES 1024
+
+// An open file and what stat(2) said about it. Entries are reference counted so concurrent
+// responses share one descriptor; they read it at explicit offsets (sendfile, pread) and never
+// move its file position. An entry that is evicted or found out of date while in use is closed
+// once the last response releases it. A negative entry (fd -1) records that there was no regular
+// file at the path, and is revalidated on the same interval.
+typedef struct FdEntry {
+    char *path; // The hash key.
+    int fd;     // -1 for a negative entry.
+    off_t size;
+    time_t mtime;
+    ino_t inode;
+    dev_t device;
+    const MimeType *mime; // Looked up by the path's extension when the file is opened.
+    uint64_t checked_ms;  // When the metadata was last compared with the file on disk.
+
+    int refs;
+    bool stale; // No longer in the table; closed when refs reaches 0.
+
+    struct FdEntry *next; // Hash chain
+    struct FdEntry *lru_prev;
+    struct FdEntry *lru_next;
+} FdEntry;
+
+/*
+Description:
+    Set up the shared descriptor cache.
+Arguments:
+    int max_files: The most entries to keep, open descriptors and missing paths alike, split
+        evenly between the stripes. Entries still in use do not count once they are evicted.
+    int revalidate_ms: How long an entry is trusted before it is checked against the file on
+        disk again. 0 checks on every request.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+int fd_cache_init(int max_files, int revalidate_ms);
+
+/*
+Description:
+    Look up an open descriptor for a regular file, opening it on a miss. An entry whose
+    revalidation interval has passed is checked with stat(2) and reopened if the file was
+    replaced or changed. Missing paths are cached too, so until the interval passes a file that
+    appears is not noticed.
+Arguments:
+    const char *path: The path of the file.
+Return value:
+    Returns the entry with a reference held, or NULL if the file cannot be opened or is not a
+    regular file. Release the entry with fd_cache_release.
+*/
+FdEntry *fd_cache_acquire(const char *path);
+
+/*
+Description:
+    Drop a reference taken by fd_cache_acquire.
+Arguments:
+    FdEntry *entry: The entry to release.
+Return value:
+    None
+*/
+void fd_cache_release(FdEntry *entry);
+
+/*
+Description:
+    Close every descriptor that is not in use.
+Arguments:
+    None
+Return value:
+    None
+*/
+void fd_cache_shutdown(void);
+
+#endif
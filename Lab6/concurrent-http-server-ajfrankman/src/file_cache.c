@@ -0,0 +1,681 @@
+#include "file_cache.h"
+#include "log.h"
+#include "metrics.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define WATCH_EVENTS                                                                   \
+    (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+     IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+#define WATCH_POLL_MS 500
+// A single file may use at most this fraction of the budget, so one big asset cannot flush
+// everything else. Bigger files are still served, just straight from disk.
+#define MAX_ENTRY_FRACTION 4
+
+typedef struct Watch {
+    int wd;
+    char *dir;
+    dev_t dev; // Identify the directory, so no directory is watched twice.
+    ino_t inode;
+} Watch;
+
+static struct {
+    bool enabled;
+    CacheEntry *buckets[FILE_CACHE_BUCKETS];
+    CacheEntry *lru_head; // Most recently used
+    CacheEntry *lru_tail;
+    size_t used;
+    size_t budget;
+    unsigned long generation; // Bumped by every invalidation.
+    pthread_mutex_t lock;
+
+    int inotify_fd;
+    Watch *watches;
+    int num_watches;
+    int watch_cap;
+    pthread_t watcher;
+    volatile bool watching;
+} C = {.lock = PTHREAD_MUTEX_INITIALIZER, .inotify_fd = -1};
+
+static unsigned long hash_path(const char *path) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *path != '\0'; path++) {
+        hash ^= (unsigned char)*path;
+        hash *= 1099511628211ULL;
+    }
+    return (unsigned long)(hash % FILE_CACHE_BUCKETS);
+}
+
+static void free_entry(CacheEntry *entry) {
+    free(entry->path);
+    free(entry->real_path);
+    free(entry->data);
+    free(entry);
+}
+
+/*
+Description:
+    Find an entry in its hash chain. Must be called with the lock held.
+Arguments:
+    const char *path: The path of the file.
+    CacheEncoding encoding: The content coding of the variant.
+    unsigned long bucket: The hash bucket of path.
+Return value:
+    Returns the entry, or NULL if it is not cached.
+*/
+static CacheEntry *find_entry(const char *path, CacheEncoding encoding, unsigned long bucket) {
+    for (CacheEntry *entry = C.buckets[bucket]; entry != NULL; entry = entry->next) {
+        if (entry->encoding == encoding && strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void lru_unlink(CacheEntry *entry) {
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        C.lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        C.lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push_front(CacheEntry *entry) {
+    entry->lru_next = C.lru_head;
+    if (C.lru_head != NULL) {
+        C.lru_head->lru_prev = entry;
+    }
+    C.lru_head = entry;
+    if (C.lru_tail == NULL) {
+        C.lru_tail = entry;
+    }
+}
+
+/*
+Description:
+    Take an entry out of the table. It is freed now if nobody is sending it, otherwise by the last
+    file_cache_release. Must be called with the lock held.
+Arguments:
+    CacheEntry *entry: The entry to remove.
+Return value:
+    None
+*/
+static void remove_entry(CacheEntry *entry) {
+    CacheEntry **link = &C.buckets[hash_path(entry->path)];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+
+    lru_unlink(entry);
+    C.used -= entry->size;
+    entry->stale = true;
+    if (entry->refs == 0) {
+        free_entry(entry);
+    }
+}
+
+/*
+Description:
+    Put a new entry in the table, evicting the least recently used ones to make room. Must be
+    called with the lock held.
+Arguments:
+    CacheEntry *entry: The entry to add.
+    unsigned long bucket: The hash bucket of its path.
+Return value:
+    None
+*/
+static void insert_entry(CacheEntry *entry, unsigned long bucket) {
+    while (C.used + entry->size > C.budget && C.lru_tail != NULL) {
+        remove_entry(C.lru_tail);
+    }
+    entry->next = C.buckets[bucket];
+    C.buckets[bucket] = entry;
+    lru_push_front(entry);
+    C.used += entry->size;
+}
+
+/*
+Description:
+    Drop every entry for a file that changed, or every entry under a directory that changed.
+    Must be called with the lock held.
+Arguments:
+    const char *real_path: The canonical path of the file or directory.
+Return value:
+    None
+*/
+static void invalidate_path(const char *real_path) {
+    size_t length = strlen(real_path);
+
+    C.generation++;
+    for (int i = 0; i < FILE_CACHE_BUCKETS; i++) {
+        CacheEntry *entry = C.buckets[i];
+        while (entry != NULL) {
+            CacheEntry *next = entry->next;
+            if (strncmp(entry->real_path, real_path, length) == 0 &&
+                (entry->real_path[length] == '\0' || entry->real_path[length] == '/')) {
+                log_info("file cache: dropping %s", entry->path);
+                remove_entry(entry);
+            }
+            entry = next;
+        }
+    }
+}
+
+static void invalidate_all(void) {
+    C.generation++;
+    while (C.lru_head != NULL) {
+        remove_entry(C.lru_head);
+    }
+}
+
+/*
+Description:
+    Read a regular file into a new, unlinked entry.
+Arguments:
+    const char *path: The file to read.
+Return value:
+    Returns the entry, or NULL if the file cannot be opened, is not a regular file, is too big or
+    memory runs out. The caller then serves it from disk.
+*/
+static CacheEntry *load_file(const char *path) {
+    struct stat info;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &info) == -1 || !S_ISREG(info.st_mode) ||
+        (size_t)info.st_size > C.budget / MAX_ENTRY_FRACTION) {
+        close(fd);
+        return NULL;
+    }
+
+    CacheEntry *entry = calloc(1, sizeof(CacheEntry));
+    if (entry == NULL) {
+        close(fd);
+        return NULL;
+    }
+    entry->size = info.st_size;
+    entry->mtime = info.st_mtime;
+    entry->inode = info.st_ino;
+    entry->mime = mime_lookup(path);
+    entry->path = strdup(path);
+    entry->real_path = realpath(path, NULL);
+    entry->data = malloc(entry->size > 0 ? entry->size : 1);
+    if (entry->path == NULL || entry->real_path == NULL || entry->data == NULL) {
+        close(fd);
+        free_entry(entry);
+        return NULL;
+    }
+
+    size_t total = 0;
+    while (total < entry->size) {
+        ssize_t bytesRead = read(fd, entry->data + total, entry->size - total);
+        if (bytesRead == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            // Truncated while we were reading it; let the caller fall back to the disk path.
+            close(fd);
+            free_entry(entry);
+            return NULL;
+        }
+        total += bytesRead;
+    }
+    close(fd);
+    return entry;
+}
+
+/*
+Description:
+    Compress a cached file into a new, unlinked gzip entry. Compression only happens once per
+    file version, so it uses the best ratio rather than the fastest level.
+Arguments:
+    const CacheEntry *source: The file to compress.
+Return value:
+    Returns the entry, or NULL on failure.
+*/
+static CacheEntry *gzip_file(const CacheEntry *source) {
+    z_stream stream = {0};
+    // 16 added to the window bits asks for a gzip header and trailer instead of zlib's.
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) !=
+        Z_OK) {
+        return NULL;
+    }
+
+    size_t bound = deflateBound(&stream, source->size);
+    CacheEntry *entry = calloc(1, sizeof(CacheEntry));
+    if (entry == NULL) {
+        deflateEnd(&stream);
+        return NULL;
+    }
+    entry->encoding = CACHE_GZIP;
+    entry->mtime = source->mtime;
+    entry->inode = source->inode;
+    entry->mime = source->mime;
+    entry->path = strdup(source->path);
+    entry->real_path = strdup(source->real_path);
+    entry->data = malloc(bound);
+    if (entry->path == NULL || entry->real_path == NULL || entry->data == NULL) {
+        deflateEnd(&stream);
+        free_entry(entry);
+        return NULL;
+    }
+
+    stream.next_in = (Bytef *)source->data;
+    stream.avail_in = source->size;
+    stream.next_out = (Bytef *)entry->data;
+    stream.avail_out = bound;
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&stream);
+        free_entry(entry);
+        return NULL;
+    }
+    entry->size = stream.total_out;
+    deflateEnd(&stream);
+    return entry;
+}
+
+/*
+Description:
+    Watch a directory and every directory under it. Symbolic links are not followed: a link to a
+    directory above would recurse forever and one to a directory outside the root would watch
+    files that are never served, since path_cache confines every path to the root. Only called
+    before the watcher starts or from the watcher thread itself, so the watch list needs no lock.
+Arguments:
+    const char *dir: The directory to watch.
+Return value:
+    None
+*/
+static void add_watches(const char *dir) {
+    struct stat dirInfo;
+    char *realDir = realpath(dir, NULL);
+    if (realDir == NULL) {
+        return;
+    }
+    if (stat(realDir, &dirInfo) == -1) {
+        free(realDir);
+        return;
+    }
+    for (int i = 0; i < C.num_watches; i++) {
+        if (C.watches[i].dev == dirInfo.st_dev && C.watches[i].inode == dirInfo.st_ino) {
+            free(realDir);
+            return;
+        }
+    }
+    if (C.num_watches == C.watch_cap) {
+        int newCap = C.watch_cap == 0 ? 16 : C.watch_cap * 2;
+        Watch *watches = realloc(C.watches, sizeof(Watch) * newCap);
+        if (watches == NULL) {
+            free(realDir);
+            return;
+        }
+        C.watches = watches;
+        C.watch_cap = newCap;
+    }
+
+    int wd = inotify_add_watch(C.inotify_fd, realDir, WATCH_EVENTS | IN_ONLYDIR);
+    if (wd == -1) {
+        log_error("inotify_add_watch %s: %s", realDir, strerror(errno));
+        free(realDir);
+        return;
+    }
+    C.watches[C.num_watches].wd = wd;
+    C.watches[C.num_watches].dir = realDir;
+    C.watches[C.num_watches].dev = dirInfo.st_dev;
+    C.watches[C.num_watches].inode = dirInfo.st_ino;
+    C.num_watches++;
+
+    DIR *directory = opendir(realDir);
+    if (directory == NULL) {
+        return;
+    }
+    struct dirent *child;
+    while ((child = readdir(directory)) != NULL) {
+        if (strcmp(child->d_name, ".") == 0 || strcmp(child->d_name, "..") == 0) {
+            continue;
+        }
+        char childPath[PATH_MAX];
+        struct stat info;
+        snprintf(childPath, sizeof childPath, "%s/%s", realDir, child->d_name);
+        if (lstat(childPath, &info) == 0 && S_ISDIR(info.st_mode)) {
+            add_watches(childPath);
+        }
+    }
+    closedir(directory);
+}
+
+static const char *find_watch(int wd) {
+    for (int i = 0; i < C.num_watches; i++) {
+        if (C.watches[i].wd == wd) {
+            return C.watches[i].dir;
+        }
+    }
+    return NULL;
+}
+
+static void remove_watch(int wd) {
+    for (int i = 0; i < C.num_watches; i++) {
+        if (C.watches[i].wd == wd) {
+            free(C.watches[i].dir);
+            C.watches[i] = C.watches[C.num_watches - 1];
+            C.num_watches--;
+            return;
+        }
+    }
+}
+
+static void *watch_thread(void *arg) {
+    (void)arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = {.fd = C.inotify_fd, .events = POLLIN};
+
+    while (C.watching) {
+        if (poll(&pfd, 1, WATCH_POLL_MS) <= 0) {
+            continue;
+        }
+        ssize_t length = read(C.inotify_fd, buf, sizeof buf);
+        if (length <= 0) {
+            continue;
+        }
+
+        const struct inotify_event *event;
+        for (char *p = buf; p < buf + length; p += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)p;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Events were lost, so nothing in the cache can be trusted.
+                pthread_mutex_lock(&C.lock);
+                invalidate_all();
+                pthread_mutex_unlock(&C.lock);
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                remove_watch(event->wd);
+                continue;
+            }
+
+            const char *dir = find_watch(event->wd);
+            if (dir == NULL) {
+                continue;
+            }
+            char path[PATH_MAX];
+            if (event->len > 0) {
+                snprintf(path, sizeof path, "%s/%s", dir, event->name);
+            } else {
+                snprintf(path, sizeof path, "%s", dir);
+            }
+
+            if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                add_watches(path);
+            }
+
+            pthread_mutex_lock(&C.lock);
+            invalidate_path(path);
+            pthread_mutex_unlock(&C.lock);
+        }
+    }
+    return NULL;
+}
+
+/*
+Description:
+    Set up the shared file cache and start watching the served folder for changes. Files under
+    the folder that change, move or are deleted are dropped from the cache.
+Arguments:
+    const char *root: The folder files are served from.
+    size_t budget: The most file data, in bytes, to keep in memory. 0 disables the cache.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+int file_cache_init(const char *root, size_t budget) {
+    C.budget = budget;
+    if (budget == 0) {
+        return 0;
+    }
+
+    // Without change notifications cached files could go stale forever, so no watcher means no
+    // cache.
+    if ((C.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+        log_error("inotify_init1: %s. File cache disabled.", strerror(errno));
+        return 1;
+    }
+    add_watches(root);
+    if (C.num_watches == 0) {
+        log_error("Could not watch %s. File cache disabled.", root);
+        close(C.inotify_fd);
+        return 1;
+    }
+
+    C.watching = true;
+    if (pthread_create(&C.watcher, NULL, watch_thread, NULL) != 0) {
+        log_error("Could not start the file cache watcher. File cache disabled.");
+        C.watching = false;
+        close(C.inotify_fd);
+        return 1;
+    }
+
+    C.enabled = true;
+    return 0;
+}
+
+/*
+Description:
+    Check whether a file of a given size would be kept by the cache, so callers can skip a lookup
+    that could only miss and reopen the file.
+Arguments:
+    size_t size: The size of the file, in bytes.
+Return value:
+    Returns true if the cache is enabled and the file is small enough to load.
+*/
+bool file_cache_fits(size_t size) {
+    return C.enabled && size <= C.budget / MAX_ENTRY_FRACTION;
+}
+
+/*
+Description:
+    Look up a file in the cache, loading it from disk on a miss if it fits in the budget.
+Arguments:
+    const char *path: The path of the file to serve.
+Return value:
+    Returns the entry with a reference held, or NULL if the file is not a regular file, is too
+    big to cache, or the cache is disabled. Release the entry with file_cache_release.
+*/
+CacheEntry *file_cache_acquire(const char *path) {
+    unsigned long bucket = hash_path(path);
+    CacheEntry *entry;
+
+    if (!C.enabled) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&C.lock);
+    if ((entry = find_entry(path, CACHE_IDENTITY, bucket)) != NULL) {
+        entry->refs++;
+        lru_unlink(entry);
+        lru_push_front(entry);
+        pthread_mutex_unlock(&C.lock);
+        metrics_add(METRIC_FILE_CACHE_HITS, 1);
+        return entry;
+    }
+    unsigned long generation = C.generation;
+    pthread_mutex_unlock(&C.lock);
+    metrics_add(METRIC_FILE_CACHE_MISSES, 1);
+
+    // Miss: read the file without holding the lock.
+    CacheEntry *loaded = load_file(path);
+    if (loaded == NULL) {
+        return NULL;
+    }
+    loaded->refs = 1;
+
+    pthread_mutex_lock(&C.lock);
+    if (generation != C.generation) {
+        // Something changed on disk while we read. Serve what we have but don't keep it.
+        loaded->stale = true;
+        pthread_mutex_unlock(&C.lock);
+        return loaded;
+    }
+    if ((entry = find_entry(path, CACHE_IDENTITY, bucket)) != NULL) {
+        // Another thread loaded it first.
+        entry->refs++;
+        pthread_mutex_unlock(&C.lock);
+        free_entry(loaded);
+        return entry;
+    }
+    insert_entry(loaded, bucket);
+    pthread_mutex_unlock(&C.lock);
+
+    return loaded;
+}
+
+CacheEntry *file_cache_acquire_gzip(CacheEntry *source) {
+    unsigned long bucket = hash_path(source->path);
+    CacheEntry *entry;
+
+    pthread_mutex_lock(&C.lock);
+    entry = find_entry(source->path, CACHE_GZIP, bucket);
+    if (entry != NULL && entry->mtime == source->mtime) {
+        entry->refs++;
+        lru_unlink(entry);
+        lru_push_front(entry);
+        pthread_mutex_unlock(&C.lock);
+        metrics_add(METRIC_FILE_CACHE_HITS, 1);
+        return entry;
+    }
+    unsigned long generation = C.generation;
+    pthread_mutex_unlock(&C.lock);
+    metrics_add(METRIC_FILE_CACHE_MISSES, 1);
+
+    // Miss: compress without holding the lock.
+    CacheEntry *compressed = gzip_file(source);
+    if (compressed == NULL) {
+        return NULL;
+    }
+    compressed->refs = 1;
+
+    pthread_mutex_lock(&C.lock);
+    if (generation != C.generation || source->stale) {
+        // Made from a version of the file that may be gone. Serve it but don't keep it.
+        compressed->stale = true;
+        pthread_mutex_unlock(&C.lock);
+        return compressed;
+    }
+    entry = find_entry(source->path, CACHE_GZIP, bucket);
+    if (entry != NULL && entry->mtime == compressed->mtime) {
+        // Another thread compressed it first.
+        entry->refs++;
+        pthread_mutex_unlock(&C.lock);
+        free_entry(compressed);
+        return entry;
+    }
+    if (entry != NULL) {
+        // Made from an older version of the file.
+        remove_entry(entry);
+    }
+    insert_entry(compressed, bucket);
+    pthread_mutex_unlock(&C.lock);
+
+    return compressed;
+}
+
+/*
+Description:
+    Look up the gzip compressed variant of a file without reading or compressing anything, for
+    a HEAD request that has to report the same body a GET would send.
+Arguments:
+    const char *path: The path the file was requested by.
+    ino_t inode: The inode of the version wanted.
+    time_t mtime: The modification time of the version wanted.
+Return value:
+    Returns the variant with a reference held, or NULL if that version has not been compressed
+    or the cache is disabled. Release it with file_cache_release.
+*/
+CacheEntry *file_cache_find_gzip(const char *path, ino_t inode, time_t mtime) {
+    unsigned long bucket = hash_path(path);
+    CacheEntry *entry;
+
+    if (!C.enabled) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&C.lock);
+    entry = find_entry(path, CACHE_GZIP, bucket);
+    if (entry == NULL || entry->inode != inode || entry->mtime != mtime) {
+        pthread_mutex_unlock(&C.lock);
+        return NULL;
+    }
+    entry->refs++;
+    lru_unlink(entry);
+    lru_push_front(entry);
+    pthread_mutex_unlock(&C.lock);
+    return entry;
+}
+
+/*
+Description:
+    Drop a reference taken by file_cache_acquire, file_cache_acquire_gzip or
+    file_cache_find_gzip.
+Arguments:
+    CacheEntry *entry: The entry to release.
+Return value:
+    None
+*/
+void file_cache_release(CacheEntry *entry) {
+    pthread_mutex_lock(&C.lock);
+    entry->refs--;
+    bool unused = entry->refs == 0 && entry->stale;
+    pthread_mutex_unlock(&C.lock);
+
+    if (unused) {
+        free_entry(entry);
+    }
+}
+
+/*
+Description:
+    Stop the watcher thread and free every entry.
+Arguments:
+    None
+Return value:
+    None
+*/
+void file_cache_shutdown(void) {
+    if (!C.enabled) {
+        return;
+    }
+    C.enabled = false;
+    C.watching = false;
+    pthread_join(C.watcher, NULL);
+    close(C.inotify_fd);
+
+    for (int i = 0; i < C.num_watches; i++) {
+        free(C.watches[i].dir);
+    }
+    free(C.watches);
+
+    pthread_mutex_lock(&C.lock);
+    invalidate_all();
+    pthread_mutex_unlock(&C.lock);
+}
@@ -0,0 +1,121 @@
+#ifndef FILE_CACHE_H_
+#define FILE_CACHE_H_
+
+#include "mime.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define FILE_CACHE_BUCKETS 1024
+
+// The content coding of a cache entry's data.
+typedef enum CacheEncoding {
+    CACHE_IDENTITY, // The file as it is on disk.
+    CACHE_GZIP,
+} CacheEncoding;
+
+// One file held in memory, either as it is on disk or compressed. Entries are reference counted:
+// a response holds a reference while it sends the data, so an entry that is evicted or
+// invalidated mid-send is only freed once the last response releases it.
+typedef struct CacheEntry {
+    char *path;             // The path the entry was requested by; the hash key.
+    char *real_path;        // The canonical path, which is what inotify events are matched against.
+    CacheEncoding encoding; // The content coding of data.
+    char *data;
+    size_t size;
+    time_t mtime;           // Of the file; a compressed variant keeps the mtime it was made from.
+    ino_t inode;            // Likewise.
+    const MimeType *mime;   // Of the file, which a compressed variant shares.
+
+    int refs;
+    bool stale; // No longer in the table; freed when refs reaches 0.
+
+    struct CacheEntry *next; // Hash chain
+    struct CacheEntry *lru_prev;
+    struct CacheEntry *lru_next;
+} CacheEntry;
+
+/*
+Description:
+    Set up the shared file cache and start watching the served folder for changes. Files under
+    the folder that change, move or are deleted are dropped from the cache.
+Arguments:
+    const char *root: The folder files are served from.
+    size_t budget: The most file data, in bytes, to keep in memory. 0 disables the cache.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+int file_cache_init(const char *root, size_t budget);
+
+/*
+Description:
+    Check whether a file of a given size would be kept by the cache, so callers can skip a lookup
+    that could only miss and reopen the file.
+Arguments:
+    size_t size: The size of the file, in bytes.
+Return value:
+    Returns true if the cache is enabled and the file is small enough to load.
+*/
+bool file_cache_fits(size_t size);
+
+/*
+Description:
+    Look up a file in the cache, loading it from disk on a miss if it fits in the budget.
+Arguments:
+    const char *path: The path of the file to serve.
+Return value:
+    Returns the entry with a reference held, or NULL if the file is not a regular file, is too
+    big to cache, or the cache is disabled. Release the entry with file_cache_release.
+*/
+CacheEntry *file_cache_acquire(const char *path);
+
+/*
+Description:
+    Look up the gzip compressed variant of a cached file, compressing it on a miss. Variants share
+    the budget with the files and are dropped with them when the file changes on disk.
+Arguments:
+    CacheEntry *source: The file, as returned by file_cache_acquire.
+Return value:
+    Returns the variant with a reference held, or NULL if compression fails. The variant is not
+    necessarily smaller than the file. Release it with file_cache_release.
+*/
+CacheEntry *file_cache_acquire_gzip(CacheEntry *source);
+
+/*
+Description:
+    Look up the gzip compressed variant of a file without reading or compressing anything, for
+    a HEAD request that has to report the same body a GET would send.
+Arguments:
+    const char *path: The path the file was requested by.
+    ino_t inode: The inode of the version wanted.
+    time_t mtime: The modification time of the version wanted.
+Return value:
+    Returns the variant with a reference held, or NULL if that version has not been compressed
+    or the cache is disabled. Release it with file_cache_release.
+*/
+CacheEntry *file_cache_find_gzip(const char *path, ino_t inode, time_t mtime);
+
+/*
+Description:
+    Drop a reference taken by file_cache_acquire, file_cache_acquire_gzip or
+    file_cache_find_gzip.
+Arguments:
+    CacheEntry *entry: The entry to release.
+Return value:
+    None
+*/
+void file_cache_release(CacheEntry *entry);
+
+/*
+Description:
+    Stop the watcher thread and free every entry.
+Arguments:
+    None
+Return value:
+    None
+*/
+void file_cache_shutdown(void);
+
+#endif
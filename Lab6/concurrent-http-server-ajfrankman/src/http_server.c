@@ -1,32 +1,45 @@
+#define _GNU_SOURCE
+
 #include "http_server.h"
 #include "log.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 #define ARG_NUM 0
 #define DEFAULT_PORT "8084"
 #define MAX_PATH_LENGTH 256
-#define TO_MANY_HEADERS 10000000
-
-char helpMessage[150] = "\n\nUsage: tcp_server [--help] [-v] [-p PORT]\n\n"
-
-                        "Options:"
-                        "  --help\n"
-                        "  -v, --verbose\n"
-                        "  --port PORT, -p PORT\n"
-                        "  --folder FOLDER, -f FOLDER\n\n";
+#define SENDFILE_UNSUPPORTED 3
+
+char helpMessage[] = "\n\nUsage: http_server [--help] [-v] [-p PORT] [-f FOLDER] [-m MODE]\n"
+                     "                   [-t N] [-a] [-q DEPTH] [-k SECONDS] [-H SECONDS]\n"
+                     "                   [-R SECONDS] [-r N] [-c MB] [-s MS] [-z BYTES] [-M]\n"
+                     "                   [-l FILE]\n\n"
+
+                     "Options:"
+                     "  --help\n"
+                     "  -v, --verbose\n"
+                     "  --port PORT, -p PORT\n"
+                     "  --folder FOLDER, -f FOLDER\n"
+                     "  --mode MODE, -m MODE (pool, epoll, reuseport, uring)\n"
+                     "  --threads N, -t N (pool workers, event loops or rings)\n"
+                     "  --pin, -a (pin each event loop to a core)\n"
+                     "  --queue DEPTH, -q DEPTH (accepted sockets waiting for a worker)\n"
+                     "  --keepalive-timeout SECONDS, -k SECONDS (0 disables keep-alive)\n"
+                     "  --header-timeout SECONDS, -H SECONDS (to send a request header block)\n"
+                     "  --request-timeout SECONDS, -R SECONDS (to receive and answer one request)\n"
+                     "  --max-requests N, -r N (requests per connection)\n"
+                     "  --cache MB, -c MB (in-memory file cache budget, 0 disables)\n"
+                     "  --stat-interval MS, -s MS (how often open files are checked for changes)\n"
+                     "  --gzip-min-size BYTES, -z BYTES (smallest file gzipped on the fly, 0 "
+                     "disables)\n"
+                     "  --metrics, -M (serve Prometheus metrics at " HTTP_SERVER_METRICS_PATH ")\n"
+                     "  --access-log FILE, -l FILE (log every request to FILE)\n"
+                     "  --delay, -d\n\n";
 
 struct addrinfo hints, *servinfo, *p;
 
-void *get_in_addr(struct sockaddr *sa) {
-    if (sa->sa_family == AF_INET) {
-        return &(((struct sockaddr_in *)sa)->sin_addr);
-    }
-
-    return &(((struct sockaddr_in6 *)sa)->sin6_addr);
-}
-
 /*
 Description:
     Make sure the message length valid.
@@ -61,15 +74,45 @@ int http_server_parse_arguments(int argc, char *argv[], Config *config) {
     bool folderSet = 0;
     log_set_quiet(true);
 
+    config->delay = false;
+    config->mode = MODE_POOL;
+    config->num_threads = 0;
+    config->pin_threads = false;
+    config->queue_depth = HTTP_SERVER_DEFAULT_QUEUE_DEPTH;
+    config->keepalive_timeout = HTTP_SERVER_DEFAULT_KEEPALIVE_TIMEOUT;
+    config->header_timeout = HTTP_SERVER_DEFAULT_HEADER_TIMEOUT;
+    config->request_timeout = HTTP_SERVER_DEFAULT_REQUEST_TIMEOUT;
+    config->max_requests = HTTP_SERVER_DEFAULT_MAX_REQUESTS;
+    config->cache_mb = HTTP_SERVER_DEFAULT_CACHE_MB;
+    config->stat_interval_ms = HTTP_SERVER_DEFAULT_STAT_INTERVAL_MS;
+    config->gzip_min_size = HTTP_SERVER_DEFAULT_GZIP_MIN_SIZE;
+    config->metrics = false;
+    config->access_log = NULL;
+
     while (1) {
         int option_index = 0;
         static struct option long_options[] = {{"help", no_argument, 0, 'h'},
                                                {"port", required_argument, 0, 'p'},
                                                {"verbose", no_argument, 0, 'v'},
                                                {"folder", required_argument, 0, 'f'},
+                                               {"mode", required_argument, 0, 'm'},
+                                               {"threads", required_argument, 0, 't'},
+                                               {"pin", no_argument, 0, 'a'},
+                                               {"queue", required_argument, 0, 'q'},
+                                               {"keepalive-timeout", required_argument, 0, 'k'},
+                                               {"header-timeout", required_argument, 0, 'H'},
+                                               {"request-timeout", required_argument, 0, 'R'},
+                                               {"max-requests", required_argument, 0, 'r'},
+                                               {"cache", required_argument, 0, 'c'},
+                                               {"stat-interval", required_argument, 0, 's'},
+                                               {"gzip-min-size", required_argument, 0, 'z'},
+                                               {"metrics", no_argument, 0, 'M'},
+                                               {"access-log", required_argument, 0, 'l'},
+                                               {"delay", no_argument, 0, 'd'},
                                                {0, 0, 0, 0}};
 
-        option = getopt_long(argc, argv, ":vp:f:h", long_options, &option_index);
+        option = getopt_long(argc, argv, ":vp:f:m:t:aq:k:H:R:r:c:s:z:Ml:dh", long_options,
+                             &option_index);
         if (option == -1)
             break;
 
@@ -94,6 +137,96 @@ int http_server_parse_arguments(int argc, char *argv[], Config *config) {
             config->relative_path = malloc(strlen(optarg) + 1);
             sprintf(config->relative_path, "%s", optarg);
             break;
+        case 'm':
+            if (strcmp(optarg, "pool") == 0) {
+                config->mode = MODE_POOL;
+            } else if (strcmp(optarg, "epoll") == 0) {
+                config->mode = MODE_EPOLL;
+            } else if (strcmp(optarg, "reuseport") == 0) {
+                config->mode = MODE_REUSEPORT;
+            } else if (strcmp(optarg, "uring") == 0) {
+                config->mode = MODE_URING;
+            } else {
+                log_error("Unknown mode: %s\n\n", optarg);
+                printf("%s", helpMessage);
+                return 1;
+            }
+            break;
+        case 't':
+            if (checkStringIsNum(optarg) == false || atoi(optarg) < 1) {
+                printf("%s", helpMessage);
+                return 1;
+            }
+            config->num_threads = atoi(optarg);
+            break;
+        case 'a':
+            config->pin_threads = true;
+            break;
+        case 'q':
+            if (checkStringIsNum(optarg) == false || atoi(optarg) < 1) {
+                printf("%s", helpMessage);
+                return 1;
+            }
+            config->queue_depth = atoi(optarg);
+            break;
+        case 'k':
+            if (checkStringIsNum(optarg) == false) {
+                printf("%s", helpMessage);
+                return 1;
+            }
+            config->keepalive_timeout = atoi(optarg);
+            break;
+        case 'H':
+            if (checkStringIsNum(optarg) == false || atoi(optarg) < 1) {
+                printf("%s", helpMessage);
+                return 1;
+            }
+            config->header_timeout = atoi(optarg);
+            break;
+        case 'R':
+            if (checkStringIsNum(optarg) == false || atoi(optarg) < 1) {
+                printf("%s", helpMessage);
+                return 1;
+            }
+            config->request_timeout = atoi(optarg);
+            break;
+        case 'r':
+            if (checkStringIsNum(optarg) == false || atoi(optarg) < 1) {
+                printf("%s", helpMessage);
+                return 1;
+            }
+            config->max_requests = atoi(optarg);
+            break;
+        case 'c':
+            if (checkStringIsNum(optarg) == false) {
+                printf("%s", helpMessage);
+                return 1;
+            }
+            config->cache_mb = atoi(optarg);
+            break;
+        case 's':
+            if (checkStringIsNum(optarg) == false) {
+                printf("%s", helpMessage);
+                return 1;
+            }
+            config->stat_interval_ms = atoi(optarg);
+            break;
+        case 'z':
+            if (checkStringIsNum(optarg) == false) {
+                printf("%s", helpMessage);
+                return 1;
+            }
+            config->gzip_min_size = atoi(optarg);
+            break;
+        case 'M':
+            config->metrics = true;
+            break;
+        case 'l':
+            config->access_log = optarg;
+            break;
+        case 'd':
+            config->delay = true;
+            break;
         case ':': // Missing option argument
             log_error("Missing option argument\n\n");
             printf("%s", helpMessage);
@@ -125,16 +258,127 @@ int http_server_parse_arguments(int argc, char *argv[], Config *config) {
         config->relative_path = ".";
     }
 
+    // Blocking pool workers spend most of their time waiting on sockets, so they get several
+    // per core. Event loops never block and only need one each.
+    if (config->num_threads == 0) {
+        config->num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (config->mode == MODE_POOL) {
+            config->num_threads *= HTTP_SERVER_POOL_THREADS_PER_CORE;
+        }
+    }
+    if (config->num_threads < 1) {
+        config->num_threads = 1;
+    }
+
+    return 0;
+}
+
+// The error responses, built by http_server_load_error_pages.
+static struct {
+    int status;
+    const char *reason;
+    const char *file;          // Looked for in the served folder.
+    const char *fallback;      // The body used when the folder has no such page.
+    const char *extra_headers; // Each ending in CRLF.
+    CannedResponse response;
+} errorPages[] = {
+    {404, "Not Found", "404.html",
+     "<html><head><title>404 Not Found</title></head>"
+     "<body><h1>404 Not Found</h1></body></html>\n",
+     "", {{NULL, NULL}, {0, 0}, 0}},
+    {405, "Method Not Allowed", "405.html",
+     "<html><head><title>405 Method Not Allowed</title></head>"
+     "<body><h1>405 Method Not Allowed</h1></body></html>\n",
+     "Allow: GET, HEAD\r\n", {{NULL, NULL}, {0, 0}, 0}},
+};
+
+/*
+Description:
+    Read a whole error page into memory.
+Arguments:
+    const char *folder: The folder the page is in.
+    const char *name: The file name of the page.
+    size_t *length: Set to the length of the page.
+Return value:
+    Returns the page, which must be freed, or NULL if it does not exist or cannot be read.
+*/
+static char *read_error_page(const char *folder, const char *name, size_t *length) {
+    char path[strlen(folder) + strlen(name) + 2];
+    struct stat info;
+
+    sprintf(path, "%s/%s", folder, name);
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    if (fstat(fileno(file), &info) == -1 || !S_ISREG(info.st_mode)) {
+        fclose(file);
+        return NULL;
+    }
+
+    char *page = malloc(info.st_size > 0 ? info.st_size : 1);
+    if (page == NULL || fread(page, 1, info.st_size, file) != (size_t)info.st_size) {
+        free(page);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    *length = info.st_size;
+    return page;
+}
+
+int http_server_load_error_pages(const char *folder) {
+    for (size_t i = 0; i < sizeof(errorPages) / sizeof(errorPages[0]); i++) {
+        size_t bodyLength;
+        char *body = read_error_page(folder, errorPages[i].file, &bodyLength);
+        if (body == NULL) {
+            log_info("No %s in %s, using the built-in page.", errorPages[i].file, folder);
+        }
+        const char *page = body != NULL ? body : errorPages[i].fallback;
+        if (body == NULL) {
+            bodyLength = strlen(page);
+        }
+
+        CannedResponse *canned = &errorPages[i].response;
+        canned->body_length = bodyLength;
+        for (int keepAlive = 0; keepAlive < 2; keepAlive++) {
+            char head[512];
+            int headLength = sprintf(head,
+                                     "%s %d %s\r\nContent-Type: text/html\r\nContent-Length: %zu"
+                                     "\r\n%sConnection: %s\r\n\r\n",
+                                     HTTP_SERVER_HTTP_VERSION, errorPages[i].status,
+                                     errorPages[i].reason, bodyLength, errorPages[i].extra_headers,
+                                     keepAlive ? "keep-alive" : "close");
+            if ((canned->data[keepAlive] = malloc(headLength + bodyLength)) == NULL) {
+                free(body);
+                return 1;
+            }
+            memcpy(canned->data[keepAlive], head, headLength);
+            memcpy(canned->data[keepAlive] + headLength, page, bodyLength);
+            canned->length[keepAlive] = headLength + bodyLength;
+        }
+        free(body);
+    }
     return 0;
 }
 
+void http_server_free_error_pages(void) {
+    for (size_t i = 0; i < sizeof(errorPages) / sizeof(errorPages[0]); i++) {
+        free(errorPages[i].response.data[0]);
+        free(errorPages[i].response.data[1]);
+        memset(&errorPages[i].response, 0, sizeof(CannedResponse));
+    }
+}
+
 ///////////////////////////////////////////////////////////////////////
 /////////////////////// SOCKET RELATED FUNCTIONS //////////////////////
 ///////////////////////////////////////////////////////////////////////
 
 /*
 Description:
-    Create and bind to a server socket using the provided configuration.
+    Create and bind to a server socket using the provided configuration. In MODE_REUSEPORT the
+    socket is bound with SO_REUSEPORT, so it can be called once per event loop to open several
+    listeners on the same port.
 Arguments:
     Config config: A config struct with the necessary information.
 Return value:
@@ -167,6 +411,11 @@ int http_server_create(Config config) {
             log_error("setsockopt");
             exit(1);
         }
+        if (config.mode == MODE_REUSEPORT &&
+            setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+            log_error("setsockopt SO_REUSEPORT: %s", strerror(errno));
+            exit(1);
+        }
 
         if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
             close(sockfd);
@@ -201,9 +450,6 @@ int http_server_accept(int socket) {
 
     struct sockaddr_storage their_addr; // connector's address information
     socklen_t sin_size;
-    char s[INET6_ADDRSTRLEN];
-
-    printf("server: waiting for connections...\n");
 
     if (listen(socket, HTTP_SERVER_BACKLOG) == -1) {
         log_error("listen");
@@ -217,345 +463,1602 @@ int http_server_accept(int socket) {
         return new_fd;
     }
 
-    inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr), s, sizeof s);
-    printf("server: got connection from %s\n", s);
-
     return new_fd;
 }
 
 /*
 Description:
-    Read data from the provided client socket, parse the data, and fill in the Request struct.
-    The buffers contained in the Request struct must be freed using http_server_client_cleanup.
+    Read the next request from a blocking client connection into conn->request. Data is pulled
+    into the connection's receive buffer with large recv() calls, and anything read past the end
+    of the request is kept for the next call. conn->request points into that buffer, so it is
+    only valid until http_server_connection_reset.
 Arguments:
-    int socket: The client socket to read from.
-    Request* request: The request struct that will be filled in.
+    Connection *conn: The client connection to read from.
 Return value:
-    Returns a 1 on failure, 0 on success.
+    Returns a 1 on failure or if the socket was shut down, 0 on success.
 */
-int http_server_receive_request(int socket, Request *request) {
-
-    request->num_headers = -1; // First part is a method not a header
-    int bytesReceived;
-    int totalBytesRecevied = 0;
-    int request_buf_size = 500;
-    char *requestBuf;
-    requestBuf = (char *)malloc(request_buf_size * sizeof(char));
-    int temp_buf_size = 500;
-    char *tempBuf;
-    tempBuf = (char *)malloc(temp_buf_size * sizeof(char));
-
-    while (true) {
-        if ((bytesReceived = recv(socket, tempBuf, 1, 0)) == -1) {
-            log_error("Did not receive all data.\n\n");
-            return 1;
-        }
-        memcpy(requestBuf + totalBytesRecevied, tempBuf, bytesReceived);
-        totalBytesRecevied += bytesReceived;
-        requestBuf[totalBytesRecevied] = '\0';
-
-        // Reallocate buffer if it is half full
-        if (strlen(requestBuf) > (size_t)(request_buf_size / 2)) {
-            request_buf_size = request_buf_size * 5;
-            requestBuf = (char *)realloc(requestBuf, request_buf_size * sizeof(char));
-        }
+int http_server_receive_request(Connection *conn) {
+    return http_server_read_request(conn) == HTTP_SERVER_IO_DONE ? 0 : 1;
+}
 
-        if (requestBuf[totalBytesRecevied - 1] == '\n') {
-            request->num_headers += 1;
-        }
-        if (requestBuf[totalBytesRecevied - 1] == '\n' &&
-            requestBuf[totalBytesRecevied - 2] == '\r' &&
-            requestBuf[totalBytesRecevied - 3] == '\n' &&
-            requestBuf[totalBytesRecevied - 4] == '\r') {
+/*
+Description:
+    Sends conn->response on a blocking client connection.
+Arguments:
+    Connection *conn: The client connection holding the response.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+int http_server_send_response(Connection *conn) {
+    if (http_server_write_response(conn) != HTTP_SERVER_IO_DONE) {
+        log_error("Could not send response");
+        return 1;
+    }
+    return 0;
+}
 
-            log_info("Found the end of the request. Parsing...");
+/*
+Description:
+    Releases the response's file and cache entry. Everything else in the response
+    lives in the connection's arena.
+Arguments:
+    int socket: The client socket to close, or -1 to leave it open.
+    Response response: The struct to clean up.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+int http_server_client_cleanup(int socket, Response response) {
+    if (socket != -1) {
+        close(socket);
+    }
 
-            break;
-        }
+    if (response.file != NULL) {
+        fd_cache_release(response.file);
+    }
+    if (response.cache_entry != NULL) {
+        file_cache_release(response.cache_entry);
     }
 
-    return (http_server_parse_request(requestBuf, request));
+    return 0;
 }
 
 /*
 Description:
-    Sends the provided Response struct on the provided client socket.
+    Cleans up allocated resources and sockets.
 Arguments:
-    int socket: The client socket to send the data with.
-    Response response: The struct containing the response data.
+    int socket: The server socket to close.
 Return value:
     Returns a 1 on failure, 0 on success.
 */
-int http_server_send_response(int socket, Response response) {
-    printf("server: sending beginning\n");
+int http_server_cleanup(int socket) { return (close(socket)); }
 
-    char *statusLine;
-    char *header;
-    unsigned long totalSentBytes = 0;
-    int chunkSize = 1024;
+///////////////////////////////////////////////////////////////////////
+///////////////////// NON-BLOCKING CONNECTION FUNCTIONS ///////////////
+///////////////////////////////////////////////////////////////////////
 
-    // Send Status Line
-    statusLine = malloc(12 + strlen(response.status));
-    sprintf(statusLine, "HTTP/1.1 %s\r\n", response.status);
-    if (send(socket, statusLine, strlen(statusLine), 0) < (ssize_t)strlen(statusLine)) {
-        log_error("Could not send statusLine");
-        return 1;
+/*
+Description:
+    Allocate the state for a newly accepted client socket. The socket may be blocking or
+    non-blocking.
+Arguments:
+    int socket: The client socket.
+Return value:
+    Returns the new Connection or NULL if it could not be allocated.
+*/
+Connection *http_server_connection_create(int socket) {
+    Connection *conn = calloc(1, sizeof(Connection));
+    if (conn == NULL) {
+        return NULL;
+    }
+    if ((conn->arena = arena_acquire()) == NULL) {
+        free(conn);
+        return NULL;
     }
+    conn->response.arena = conn->arena;
+    conn->idle_since_ms = timer_wheel_now_ms();
+    conn->timer.data = conn;
+    conn->socket = socket;
+    conn->state = CONN_READING;
+    if (access_log_enabled()) {
+        access_log_client(socket, &conn->client);
+    }
+    metrics_add(METRIC_CONNECTIONS_OPENED, 1);
+    return conn;
+}
 
-    header = malloc(strlen(response.headers[0]->name) + strlen(response.headers[0]->value) + 8);
-    sprintf(header, "%s: %s\r\n\r\n", response.headers[0]->name, response.headers[0]->value);
-    if (send(socket, header, strlen(header), 0) < (ssize_t)strlen(header)) {
-        log_error("Could not send header");
-        return 1;
+/*
+Description:
+    Look for the blank line that ends the header block, starting where the previous search
+    stopped.
+Arguments:
+    Connection *conn: The connection whose receive buffer is searched.
+Return value:
+    Returns the length of the header block including the blank line, or 0 if it is not complete.
+*/
+static size_t find_request_end(Connection *conn) {
+    size_t i = conn->scan_pos;
+    // The terminator can straddle two reads, so back up over a possible partial match.
+    i = (i > 3) ? i - 3 : 0;
+    for (; i + 3 < conn->recv_len; i++) {
+        if (conn->recv_buf[i] == '\r' && conn->recv_buf[i + 1] == '\n' &&
+            conn->recv_buf[i + 2] == '\r' && conn->recv_buf[i + 3] == '\n') {
+            return i + 4;
+        }
     }
+    conn->scan_pos = conn->recv_len;
+    return 0;
+}
 
-    // Get size of file
-    fseek(response.file, 0, SEEK_END);
-    unsigned long file_length = (unsigned long)ftell(response.file);
-    // Go back to the beginning
-    fseek(response.file, 0, SEEK_SET);
+/*
+Description:
+    Parse the next request out of the bytes already in the receive buffer, without touching the
+    socket. If the header block is not complete yet, make sure the buffer has room for more.
+Arguments:
+    Connection *conn: The connection whose receive buffer is parsed.
+Return value:
+    Returns HTTP_SERVER_IO_DONE once a request is parsed into conn->request,
+    HTTP_SERVER_IO_AGAIN if more bytes are needed, in which case conn->recv_buf has room for
+    conn->recv_cap - conn->recv_len - 1 of them, and HTTP_SERVER_IO_ERROR on a size or parse error.
+*/
+int http_server_take_request(Connection *conn) {
+    size_t requestLength = find_request_end(conn);
+
+    // The receive phase starts with the first byte of the request, whether it just arrived or
+    // was pipelined behind the previous one.
+    if (conn->phase_start_ns == 0 && conn->recv_len > 0) {
+        conn->phase_start_ns = metrics_now_ns();
+        conn->request_start_ns = conn->phase_start_ns;
+    }
 
-    // int outerLoop = 0;
-    // int innerLoop = 0;
-    while (true) {
-        char tempBuf[chunkSize];
-        int sentAmount = 0;
-        int readAmount = 0;
-        int sendValue = 0;
-        readAmount = fread(tempBuf, sizeof(char), chunkSize, response.file);
-
-        // printf("Send ammount outer: %d\n", outerLoop);
-        // outerLoop++;
-        while (sentAmount < readAmount) {
-            // printf("Send ammount inner: %d\n", innerLoop);
-            // innerLoop++;
-            sendValue = send(socket, tempBuf + sentAmount, readAmount - sentAmount, 0);
-
-            if (sendValue != -1) {
-                sentAmount += sendValue;
-            } else if (sendValue == -1) {
-                printf("NEGATIVE 1\n");
-                return 0;
+    if (requestLength == 0) {
+        if (conn->recv_len + 1 >= conn->recv_cap) {
+            if (conn->recv_cap >= HTTP_SERVER_MAX_REQUEST_SIZE) {
+                log_error("Request header block too large.");
+                return HTTP_SERVER_IO_ERROR;
             }
+            size_t newCap = conn->recv_cap == 0 ? HTTP_SERVER_RECV_CHUNK : conn->recv_cap * 2;
+            char *newBuf = realloc(conn->recv_buf, newCap);
+            if (newBuf == NULL) {
+                return HTTP_SERVER_IO_ERROR;
+            }
+            conn->recv_buf = newBuf;
+            conn->recv_cap = newCap;
         }
-        totalSentBytes += readAmount;
+        return HTTP_SERVER_IO_AGAIN;
+    }
 
-        log_info("file_length: %d  totalSentBytes: %d\n", file_length, totalSentBytes);
+    // Anything past the header block is the start of the next pipelined request.
+    conn->request_len = requestLength;
+    if (http_server_parse_request(conn->recv_buf, requestLength, &conn->request) == 1) {
+        log_error("Could not parse request.");
+        return HTTP_SERVER_IO_ERROR;
+    }
+    uint64_t now = metrics_now_ns();
+    metrics_observe(METRIC_RECEIVE, now - conn->phase_start_ns);
+    conn->phase_start_ns = now;
+    return HTTP_SERVER_IO_DONE;
+}
 
-        if (totalSentBytes == file_length) {
-            printf("OOPS\n");
-            return 0;
+/*
+Description:
+    Receive as much of the request as the socket has available. Once the whole header block is
+    in, parse it into conn->request.
+Arguments:
+    Connection *conn: The connection to read on.
+Return value:
+    Returns HTTP_SERVER_IO_DONE once a request is parsed, HTTP_SERVER_IO_AGAIN if the socket ran
+    out of data first, and HTTP_SERVER_IO_ERROR on a socket, size or parse error.
+*/
+int http_server_read_request(Connection *conn) {
+    int result;
+
+    while ((result = http_server_take_request(conn)) == HTTP_SERVER_IO_AGAIN) {
+        ssize_t bytesReceived = recv(conn->socket, conn->recv_buf + conn->recv_len,
+                                     conn->recv_cap - conn->recv_len - 1, 0);
+        if (bytesReceived == 0) {
+            return HTTP_SERVER_IO_ERROR;
+        } else if (bytesReceived == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return HTTP_SERVER_IO_AGAIN;
+            }
+            log_error("recv: %s", strerror(errno));
+            return HTTP_SERVER_IO_ERROR;
         }
+        conn->recv_len += bytesReceived;
     }
-
-    return 1;
+    return result;
 }
 
 /*
 Description:
-    Cleans up allocated resources and sockets.
+    Serialize the status line and headers of the response into conn->send_buf.
 Arguments:
-    int socket: The client socket to close.
-    Request request: The strcut to clean up.
-    Response response: The struct to clean up.
+    Connection *conn: The connection holding the response.
 Return value:
     Returns a 1 on failure, 0 on success.
 */
-int http_server_client_cleanup(int socket, Request request, Response response) {
-    log_info("Cleaning Client");
-    if (socket != -1) {
-        close(socket);
-    }
+int http_server_serialize_response_head(Connection *conn) {
+    Response *response = &conn->response;
+    uint64_t now = metrics_now_ns();
 
-    log_info("request.num_headers = %d", request.num_headers);
-
-    for (int i = 0; i < request.num_headers - 2; i++) {
-        if (request.headers[i]->name != NULL)
-            free(request.headers[i]->name);
-        if (request.headers[i]->value != NULL)
-            free(request.headers[i]->value);
-        if (request.headers[i] != NULL)
-            free(request.headers[i]);
+    // Every backend serializes the head once the response is built, so processing ends here.
+    if (conn->phase_start_ns != 0) {
+        metrics_observe(METRIC_PROCESS, now - conn->phase_start_ns);
     }
-    if (request.headers != NULL)
-        free(request.headers);
-
-    if (request.path != NULL)
-        free(request.path);
-    if (request.method != NULL)
-        free(request.method);
-
-    for (int i = 0; i < response.num_headers; i++) {
-        if (response.headers[i]->name != NULL)
-            free(response.headers[i]->name);
-        if (response.headers[i]->value != NULL)
-            free(response.headers[i]->value);
-        if (response.headers[i] != NULL)
-            free(response.headers[i]);
+    conn->phase_start_ns = now;
+
+    if (response->canned != NULL) {
+        // Preloaded error responses are serialized already, body and all.
+        const CannedResponse *canned = response->canned;
+        conn->send_buf = canned->data[conn->keep_alive];
+        conn->send_len = canned->length[conn->keep_alive];
+        if (response->head) {
+            conn->send_len -= canned->body_length;
+        }
+        conn->send_pos = 0;
+        return 0;
     }
+    size_t length = strlen(HTTP_SERVER_HTTP_VERSION) + strlen(response->status) + 5;
 
-    log_info("Done freeing");
+    for (int i = 0; i < response->num_headers; i++) {
+        length += strlen(response->headers[i]->name) + strlen(response->headers[i]->value) + 4;
+    }
 
-    if (response.file != NULL) {
-        fclose(response.file);
+    if ((conn->send_buf = arena_alloc(conn->arena, length + 1)) == NULL) {
+        return 1;
     }
-    response.file = NULL;
 
-    if (response.status != NULL)
-        free(response.status);
+    int offset = sprintf(conn->send_buf, "%s %s\r\n", HTTP_SERVER_HTTP_VERSION, response->status);
+    for (int i = 0; i < response->num_headers; i++) {
+        offset += sprintf(conn->send_buf + offset, "%s: %s\r\n", response->headers[i]->name,
+                          response->headers[i]->value);
+    }
+    offset += sprintf(conn->send_buf + offset, "\r\n");
 
+    conn->send_len = offset;
+    conn->send_pos = 0;
     return 0;
 }
 
 /*
 Description:
-    Cleans up allocated resources and sockets.
+    Send buf[*pos..len) on the socket, advancing *pos by however much the kernel accepted.
 Arguments:
-    int socket: The server socket to close.
+    int socket: The socket to send on.
+    const char *buf: The data to send.
+    size_t len: The total length of buf.
+    size_t *pos: How much of buf has already been sent.
+    int flags: Extra send(2) flags, such as MSG_MORE.
 Return value:
-    Returns a 1 on failure, 0 on success.
+    Returns HTTP_SERVER_IO_DONE, HTTP_SERVER_IO_AGAIN or HTTP_SERVER_IO_ERROR.
 */
-int http_server_cleanup(int socket) { return (close(socket)); }
-
-///////////////////////////////////////////////////////////////////////
-////////////////////// PROTOCOL RELATED FUNCTIONS /////////////////////
-///////////////////////////////////////////////////////////////////////
+static int send_pending(int socket, const char *buf, size_t len, size_t *pos, int flags) {
+    while (*pos < len) {
+        ssize_t sent = send(socket, buf + *pos, len - *pos, flags | MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return HTTP_SERVER_IO_AGAIN;
+            }
+            log_error("send: %s", strerror(errno));
+            return HTTP_SERVER_IO_ERROR;
+        }
+        *pos += sent;
+    }
+    return HTTP_SERVER_IO_DONE;
+}
 
-// A helper function to be used inside of http_server_receive_request. This should not be used
-// directly in main.c.
 /*
 Description:
-    Converts a string into a request struct. A helper function to be used
-    inside of http_server_receive_request. This should not be used directly
-    in main.c.
+    Find the rest of the body part that the next send should start with, given the
+    conn->body_sent bytes of the body already sent.
 Arguments:
-    char *buf: The string containing the request.
-    Request *request: The request struct that will be filled in by buf.
+    Connection *conn: The connection holding the response.
+    const char **data: Set to the bytes to send when they are in memory, otherwise to NULL.
+    off_t *offset: Set to where the bytes start in conn->response.file when data is NULL.
+    size_t *length: Set to how many bytes are left in the part.
 Return value:
-    Returns a 1 on failure, 0 on success.
+    Returns false once the whole body has been sent.
 */
-int http_server_parse_request(char *requestBuf, Request *request) {
-
-    char *beginLine = NULL;
-    char *value = NULL;
-    char *endLine = NULL;
-
-    // Set Method
-    beginLine = requestBuf;
-    endLine = strchr(beginLine, ' ');
-    request->method = malloc(endLine - beginLine + 1);
-    memcpy(request->method, beginLine, endLine - beginLine);
-    request->method[endLine - beginLine] = '\0';
-
-    // Set Path
-    beginLine = endLine + 1;
-    endLine = strchr(beginLine, ' ');
-    request->path = malloc(endLine - beginLine + 1);
-    memcpy(request->path, beginLine, endLine - beginLine);
-    request->path[endLine - beginLine] = '\0';
-
-    endLine = strchr(beginLine, '\n');
+bool http_server_next_body_span(Connection *conn, const char **data, off_t *offset,
+                                size_t *length) {
+    Response *response = &conn->response;
+    unsigned long position = conn->body_sent;
+
+    for (int i = 0; i < response->num_parts; i++) {
+        BodyPart *part = &response->parts[i];
+        if (position >= part->length) {
+            position -= part->length;
+            continue;
+        }
+        *length = part->length - position;
+        if (part->data != NULL) {
+            *data = part->data + position;
+        } else if (response->cache_entry != NULL) {
+            *data = response->cache_entry->data + part->offset + position;
+        } else {
+            *data = NULL;
+            *offset = (off_t)(part->offset + position);
+        }
+        return true;
+    }
+    return false;
+}
 
-    request->headers = malloc(sizeof(Header *) * request->num_headers);
+/*
+Description:
+    Send the rest of the response head together with an in-memory piece of the body. Both go to
+    the kernel in one sendmsg(2) call, so a small response leaves in a single segment. Handles
+    partial sends by resuming at conn->send_pos and advancing conn->body_sent.
+Arguments:
+    Connection *conn: The connection to write on.
+    const char *data: The rest of the body part, from http_server_next_body_span.
+    size_t length: The length of data.
+    int flags: Extra send(2) flags, such as MSG_MORE.
+Return value:
+    Returns HTTP_SERVER_IO_DONE, HTTP_SERVER_IO_AGAIN or HTTP_SERVER_IO_ERROR.
+*/
+static int send_head_and_span(Connection *conn, const char *data, size_t length, int flags) {
+    size_t spanSent = 0;
+
+    while (conn->send_pos < conn->send_len) {
+        struct iovec parts[2] = {
+            {conn->send_buf + conn->send_pos, conn->send_len - conn->send_pos},
+            {(char *)data + spanSent, length - spanSent},
+        };
+        struct msghdr message = {.msg_iov = parts, .msg_iovlen = 2};
+        ssize_t sent = sendmsg(conn->socket, &message, flags | MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return HTTP_SERVER_IO_AGAIN;
+            }
+            log_error("sendmsg: %s", strerror(errno));
+            return HTTP_SERVER_IO_ERROR;
+        }
+        size_t headSent = (size_t)sent < parts[0].iov_len ? (size_t)sent : parts[0].iov_len;
+        conn->send_pos += headSent;
+        spanSent += sent - headSent;
+        conn->body_sent += sent - headSent;
+    }
 
-    int nameLength;
-    int valueLength;
-    for (int i = 0; i < TO_MANY_HEADERS; i++) {
-        beginLine = endLine + 1;
-        value = strchr(beginLine, ':') + 2;
-        endLine = strchr(beginLine, '\n');
+    size_t spanPos = spanSent;
+    int result = send_pending(conn->socket, data, length, &spanPos, flags);
+    conn->body_sent += spanPos - spanSent;
+    return result;
+}
 
-        log_info("beginLine to value:%.*s", value - beginLine, beginLine);
-        log_info("value to endLine:%.*s", endLine - value, value);
+/*
+Description:
+    Stream a slice of the response file to the socket with sendfile(2), which copies straight
+    from the page cache without going through user space. Advances conn->body_sent by what was
+    sent.
+Arguments:
+    Connection *conn: The connection whose response file is sent.
+    off_t offset: Where the rest of the slice starts in the file.
+    size_t length: How much of the slice is left.
+Return value:
+    Returns HTTP_SERVER_IO_DONE, HTTP_SERVER_IO_AGAIN or HTTP_SERVER_IO_ERROR, or
+    SENDFILE_UNSUPPORTED if this file/socket pair cannot use sendfile.
+*/
+static int send_file_span(Connection *conn, off_t offset, size_t length) {
+    int fileFd = conn->response.file->fd;
+    size_t spanSent = 0;
+
+    while (spanSent < length) {
+        off_t position = offset + (off_t)spanSent;
+        ssize_t sent = sendfile(conn->socket, fileFd, &position, length - spanSent);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return HTTP_SERVER_IO_AGAIN;
+            } else if ((errno == EINVAL || errno == ENOSYS) && spanSent == 0) {
+                return SENDFILE_UNSUPPORTED;
+            }
+            log_error("sendfile: %s", strerror(errno));
+            return HTTP_SERVER_IO_ERROR;
+        }
+        if (sent == 0) {
+            log_error("File ended before Content-Length was sent.");
+            return HTTP_SERVER_IO_ERROR;
+        }
+        spanSent += sent;
+        conn->body_sent += sent;
+    }
+    return HTTP_SERVER_IO_DONE;
+}
 
-        request->headers[i] = malloc(sizeof(Header));
+/*
+Description:
+    Read the next chunk of a file slice into conn->chunk, for when sendfile cannot be used, and
+    start sending it. Advances conn->body_sent by what was read.
+Arguments:
+    Connection *conn: The connection whose response file is sent.
+    off_t offset: Where the rest of the slice starts in the file.
+    size_t length: How much of the slice is left.
+Return value:
+    Returns HTTP_SERVER_IO_DONE, HTTP_SERVER_IO_AGAIN or HTTP_SERVER_IO_ERROR.
+*/
+static int copy_file_span(Connection *conn, off_t offset, size_t length) {
+    if (conn->chunk == NULL && (conn->chunk = malloc(HTTP_SERVER_FILE_CHUNK)) == NULL) {
+        return HTTP_SERVER_IO_ERROR;
+    }
 
-        nameLength = value - beginLine - 2;
-        request->headers[i]->name = malloc(nameLength + 1);
-        memcpy(request->headers[i]->name, beginLine, nameLength);
-        request->headers[i]->name[value - 2 - beginLine] = '\0';
+    size_t wanted = length < HTTP_SERVER_FILE_CHUNK ? length : HTTP_SERVER_FILE_CHUNK;
+    ssize_t bytesRead;
+    do {
+        bytesRead = pread(conn->response.file->fd, conn->chunk, wanted, offset);
+    } while (bytesRead == -1 && errno == EINTR);
+    if (bytesRead <= 0) {
+        log_error("File ended before Content-Length was sent.");
+        return HTTP_SERVER_IO_ERROR;
+    }
+    conn->chunk_len = bytesRead;
+    conn->chunk_pos = 0;
+    conn->body_sent += bytesRead;
 
-        valueLength = endLine - value;
-        request->headers[i]->value = malloc(valueLength + 1);
-        memcpy(request->headers[i]->value, value, valueLength);
-        request->headers[i]->value[endLine - value] = '\0';
+    return send_pending(conn->socket, conn->chunk, conn->chunk_len, &conn->chunk_pos, 0);
+}
 
-        log_info("This is request->headers[%d]->name: %s", i, request->headers[i]->name);
-        log_info("This is request->headers[%d]->value: %s", i, request->headers[i]->value);
+/*
+Description:
+    Send as much of conn->response as the socket will take, picking up where the last call left
+    off.
+Arguments:
+    Connection *conn: The connection to write on.
+Return value:
+    Returns HTTP_SERVER_IO_DONE once the whole response is sent, HTTP_SERVER_IO_AGAIN if the
+    socket buffer filled up first, and HTTP_SERVER_IO_ERROR on a socket or file error.
+*/
+int http_server_write_response(Connection *conn) {
+    const char *data;
+    off_t offset;
+    size_t length;
+    int result;
+
+    if (conn->send_buf == NULL && http_server_serialize_response_head(conn) == 1) {
+        return HTTP_SERVER_IO_ERROR;
+    }
 
-        // Alternatively I could add a counter that checks if we have done the correct number of
-        // headers. That may be a cleaner option.
+    while (true) {
+        // File bytes already copied into the chunk go before anything else.
+        if ((result = send_pending(conn->socket, conn->chunk, conn->chunk_len, &conn->chunk_pos,
+                                   0)) != HTTP_SERVER_IO_DONE) {
+            return result;
+        }
 
-        if (beginLine[endLine - beginLine - 1] == '\r' && endLine[0] == '\n' &&
-            endLine[1] == '\r' && endLine[2] == '\n') {
-            return 0;
+        if (!http_server_next_body_span(conn, &data, &offset, &length)) {
+            result = send_pending(conn->socket, conn->send_buf, conn->send_len, &conn->send_pos, 0);
+            if (result == HTTP_SERVER_IO_DONE) {
+                http_server_response_sent(conn);
+            }
+            return result;
+        }
+        // MSG_MORE holds back a head or part that is not the end of the response until the
+        // bytes after it join it, so it shares a segment instead of going out in a tiny one.
+        int more = conn->body_sent + length < conn->response.content_length ? MSG_MORE : 0;
+
+        if (data != NULL) {
+            result = send_head_and_span(conn, data, length, more);
+        } else if ((result = send_pending(conn->socket, conn->send_buf, conn->send_len,
+                                          &conn->send_pos, MSG_MORE)) == HTTP_SERVER_IO_DONE) {
+            if (!conn->buffered_body &&
+                (result = send_file_span(conn, offset, length)) == SENDFILE_UNSUPPORTED) {
+                // Fall back to copying the file through user space for the rest of this
+                // response.
+                conn->buffered_body = true;
+            }
+            if (conn->buffered_body) {
+                result = copy_file_span(conn, offset, length);
+            }
+        }
+        if (result != HTTP_SERVER_IO_DONE) {
+            return result;
         }
     }
-    return 1;
 }
 
 /*
 Description:
-    Convert a Request struct into a Response struct. This function will allocate the necessary
-    buffers to fill in the Response struct. The buffers contained in the Response struct must be
-    freeded using http_server_client_cleanup.
+    Record a response that has been sent in full in the metrics, its status, its size and how
+    long it took to send, and in the access log. http_server_write_response calls it itself;
+    backends that send the response on their own call it once the last byte is out.
 Arguments:
-    Request request: The request struct that will be processed.
-    char *relative_path: The path to server the files from.
-    Response *response: The response struct that will be filled in.
+    Connection *conn: The connection holding the response.
 Return value:
-    Returns a 1 on failure, 0 on success.
+    None
 */
-int http_server_process_request(Request request, char *relative_path, Response *response) {
+void http_server_response_sent(Connection *conn) {
+    Response *response = &conn->response;
+    int status = response->status != NULL ? atoi(response->status) : 0;
+    uint64_t bytes = conn->send_len + response->content_length;
+    uint64_t now = metrics_now_ns();
+
+    metrics_count_status(status);
+    metrics_add(METRIC_BYTES_SENT, bytes);
+    if (conn->phase_start_ns != 0) {
+        metrics_observe(METRIC_SEND, now - conn->phase_start_ns);
+        conn->phase_start_ns = 0;
+    }
+    if (access_log_enabled()) {
+        Request *request = &conn->request;
+        access_log_write(&conn->client, request->method.data, request->method.length,
+                         request->path.data, request->path.length, status, bytes,
+                         conn->request_start_ns != 0 ? now - conn->request_start_ns : 0);
+    }
+}
 
-    char status[10];
-    FILE *myFile;
-    char fileLengthString[100];
+/*
+Description:
+    Work out when a connection should be closed if it makes no further progress. An idle
+    connection gets the keep-alive timeout, or the header timeout before its first request. Once
+    the first bytes of a request arrive, the whole header block has to be in within the header
+    timeout, however slowly it trickles in, and the response has to be sent within the request
+    timeout of that first byte. Call it after every read or write the connection makes.
+Arguments:
+    Connection *conn: The connection.
+    Config config: The server configuration with the timeouts.
+    uint64_t now_ms: The current time from timer_wheel_now_ms.
+Return value:
+    Returns the deadline on the timer_wheel_now_ms clock.
+*/
+uint64_t http_server_connection_deadline(Connection *conn, Config config, uint64_t now_ms) {
+    if (conn->request_start_ms == 0 && (conn->recv_len > 0 || conn->state != CONN_READING)) {
+        conn->request_start_ms = now_ms;
+    }
+
+    if (conn->state != CONN_READING) {
+        return conn->request_start_ms + (uint64_t)config.request_timeout * 1000;
+    } else if (conn->request_start_ms != 0) {
+        return conn->request_start_ms + (uint64_t)config.header_timeout * 1000;
+    } else if (conn->requests_served > 0 && config.keepalive_timeout > 0) {
+        return conn->idle_since_ms + (uint64_t)config.keepalive_timeout * 1000;
+    }
+    return conn->idle_since_ms + (uint64_t)config.header_timeout * 1000;
+}
+
+/*
+Description:
+    Close the client socket and free the connection along with its request and response.
+Arguments:
+    Connection *conn: The connection to destroy.
+Return value:
+    None
+*/
+void http_server_connection_destroy(Connection *conn) {
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+    http_server_client_cleanup(conn->socket, conn->response);
+    arena_release(conn->arena);
+    free(conn->recv_buf);
+    free(conn->chunk);
+    free(conn);
+}
+
+/*
+Description:
+    Free the request and response of a connection that is being kept alive and get it ready to
+    read the next request on the same socket.
+Arguments:
+    Connection *conn: The connection to reset.
+Return value:
+    None
+*/
+void http_server_connection_reset(Connection *conn) {
+    http_server_client_cleanup(-1, conn->response);
+    conn->request.num_headers = 0;
+    memset(&conn->response, 0, sizeof(Response));
+    arena_reset(conn->arena);
+    conn->response.arena = conn->arena;
+
+    conn->send_buf = NULL;
+    conn->send_len = 0;
+    conn->send_pos = 0;
+    conn->chunk_len = 0;
+    conn->chunk_pos = 0;
+    conn->body_sent = 0;
+    conn->buffered_body = false;
+
+    // Keep any pipelined requests that arrived behind this one. The next read parses them
+    // straight from the buffer before touching the socket again.
+    conn->recv_len -= conn->request_len;
+    memmove(conn->recv_buf, conn->recv_buf + conn->request_len, conn->recv_len);
+    conn->request_len = 0;
+    conn->scan_pos = 0;
+    conn->state = CONN_READING;
+    conn->idle_since_ms = timer_wheel_now_ms();
+    conn->request_start_ms = 0;
+    conn->phase_start_ns = 0;
+    conn->request_start_ns = 0;
+}
+
+///////////////////////////////////////////////////////////////////////
+////////////////////// PROTOCOL RELATED FUNCTIONS /////////////////////
+///////////////////////////////////////////////////////////////////////
+
+// A helper function to be used inside of http_server_read_request. This should not be used
+// directly in main.c.
+/*
+Description:
+    Converts a header block into a request struct without allocating. The fields of the request
+    point into buf. A helper function to be used inside of http_server_read_request. This should
+    not be used directly in main.c.
+Arguments:
+    const char *buf: The header block, ending with the blank line. It need not be NUL-terminated.
+    size_t length: The length of the header block.
+    Request *request: The request struct that will be filled in by buf.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+int http_server_parse_request(const char *requestBuf, size_t length, Request *request) {
+
+    const char *beginLine = NULL;
+    const char *value = NULL;
+    const char *endLine = NULL;
+    const char *end = requestBuf + length;
+
+    request->num_headers = 0;
+
+    // Set Method
+    beginLine = requestBuf;
+    if ((endLine = memchr(beginLine, ' ', end - beginLine)) == NULL)
+        return 1;
+    request->method.data = beginLine;
+    request->method.length = endLine - beginLine;
+
+    // Set Path
+    beginLine = endLine + 1;
+    if ((endLine = memchr(beginLine, ' ', end - beginLine)) == NULL)
+        return 1;
+    request->path.data = beginLine;
+    request->path.length = endLine - beginLine;
 
-    int fullPathLength = strlen(relative_path) + strlen(request.path);
-    char fullPath[fullPathLength];
-    sprintf(fullPath, "%s%s", relative_path, request.path);
-    printf("fullPath: %s\n", fullPath);
+    // Set Version
+    beginLine = endLine + 1;
+    if ((endLine = memchr(beginLine, '\n', end - beginLine)) == NULL)
+        return 1;
+    request->version.data = beginLine;
+    request->version.length = endLine - beginLine;
+    if (request->version.length > 0 && beginLine[request->version.length - 1] == '\r')
+        request->version.length--;
 
-    if (strcmp(request.method, "GET") != 0) {
-        if ((myFile = fopen("www/405.html", "r")) == NULL)
+    while (true) {
+        beginLine = endLine + 1;
+
+        // The blank line ends the header block.
+        if (beginLine >= end || beginLine[0] == '\n' ||
+            (beginLine[0] == '\r' && beginLine + 1 < end && beginLine[1] == '\n')) {
+            return 0;
+        }
+        if (request->num_headers == HTTP_SERVER_MAX_HEADERS) {
+            log_error("Too many headers.");
             return 1;
-        log_error("Method Not Allowed");
-        sprintf(status, "%d", 404);
-        response->status = calloc(1, 10);
-        memcpy(response->status, status, strlen(status));
-    } else if ((myFile = fopen(fullPath, "r")) != NULL) {
-        sprintf(status, "%d", 200);
-        response->status = calloc(1, 10);
-        memcpy(response->status, status, strlen(status));
+        }
+        if ((endLine = memchr(beginLine, '\n', end - beginLine)) == NULL)
+            return 1;
+        if ((value = memchr(beginLine, ':', endLine - beginLine)) == NULL)
+            return 1;
+
+        HeaderSlice *header = &request->headers[request->num_headers];
+        header->name.data = beginLine;
+        header->name.length = value - beginLine;
+
+        value++;
+        while (value < endLine && (*value == ' ' || *value == '\t'))
+            value++;
+        header->value.data = value;
+        header->value.length = endLine - value;
+        if (header->value.length > 0 && value[header->value.length - 1] == '\r')
+            header->value.length--;
+
+        request->num_headers++;
+    }
+}
+
+/*
+Description:
+    Compare a request slice with a string.
+Arguments:
+    Slice slice: The slice to compare.
+    const char *str: The NUL-terminated string to compare it with.
+Return value:
+    Returns true if they are equal. http_server_slice_equals_ignore_case ignores ASCII case.
+*/
+bool http_server_slice_equals(Slice slice, const char *str) {
+    return strlen(str) == slice.length && memcmp(slice.data, str, slice.length) == 0;
+}
+
+bool http_server_slice_equals_ignore_case(Slice slice, const char *str) {
+    return strlen(str) == slice.length && strncasecmp(slice.data, str, slice.length) == 0;
+}
+
+/*
+Description:
+    Find a request header by name. Header names are case-insensitive.
+Arguments:
+    Request *request: The request to search.
+    const char *name: The header name to look for.
+Return value:
+    Returns the header value, or NULL if the request does not have that header.
+*/
+Slice *http_server_get_header(Request *request, const char *name) {
+    for (int i = 0; i < request->num_headers; i++) {
+        if (http_server_slice_equals_ignore_case(request->headers[i].name, name)) {
+            return &request->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+/*
+Description:
+    Append a header to the response. The name and value are copied into the response's arena.
+Arguments:
+    Response *response: The response to add the header to.
+    const char *name: The header name.
+    const char *value: The header value.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+int http_server_add_header(Response *response, const char *name, const char *value) {
+    if (response->num_headers == response->header_cap) {
+        // Arena memory cannot be resized, so grow by copying into a new, bigger array.
+        int newCap = response->header_cap == 0 ? 8 : response->header_cap * 2;
+        Header **headers = arena_alloc(response->arena, sizeof(Header *) * newCap);
+        if (headers == NULL) {
+            return 1;
+        }
+        if (response->num_headers > 0) {
+            memcpy(headers, response->headers, sizeof(Header *) * response->num_headers);
+        }
+        response->headers = headers;
+        response->header_cap = newCap;
+    }
+
+    Header *header = arena_alloc(response->arena, sizeof(Header));
+    if (header == NULL) {
+        return 1;
+    }
+    header->name = arena_strdup(response->arena, name);
+    header->value = arena_strdup(response->arena, value);
+    if (header->name == NULL || header->value == NULL) {
+        return 1;
+    }
+    response->headers[response->num_headers] = header;
+    response->num_headers++;
+    return 0;
+}
+
+/*
+Description:
+    Check whether a comma separated header value such as "keep-alive, Upgrade" contains token.
+Arguments:
+    Slice value: The header value.
+    const char *token: The token to look for, case-insensitive.
+Return value:
+    Returns true if the token is in the list.
+*/
+static bool header_has_token(Slice value, const char *token) {
+    const char *c = value.data;
+    const char *end = value.data + value.length;
+
+    while (c < end) {
+        while (c < end && (*c == ' ' || *c == '\t' || *c == ','))
+            c++;
+        Slice item = {c, 0};
+        while (c < end && *c != ',')
+            c++;
+        item.length = c - item.data;
+        while (item.length > 0 &&
+               (item.data[item.length - 1] == ' ' || item.data[item.length - 1] == '\t'))
+            item.length--;
+        if (item.length > 0 && http_server_slice_equals_ignore_case(item, token))
+            return true;
+    }
+    return false;
+}
+
+/*
+Description:
+    Decide whether the connection stays open after this response and add the matching
+    Connection (and Keep-Alive) headers to it. HTTP/1.1 connections persist unless the client
+    sends "Connection: close"; HTTP/1.0 ones only when it asks for keep-alive.
+Arguments:
+    Request *request: The request being answered.
+    Response *response: The response to add the headers to.
+    int requests_served: How many requests this connection has answered, including this one.
+    Config config: The server configuration with the keep-alive limits.
+Return value:
+    Returns true if the connection should be kept open.
+*/
+bool http_server_set_keep_alive(Request *request, Response *response, int requests_served,
+                                Config config) {
+    Slice *connection = http_server_get_header(request, "Connection");
+    bool keepAlive;
+
+    if (connection != NULL && header_has_token(*connection, "close")) {
+        keepAlive = false;
+    } else if (connection != NULL && header_has_token(*connection, "keep-alive")) {
+        keepAlive = true;
     } else {
-        if ((myFile = fopen("www/404.html", "r")) == NULL)
+        keepAlive = http_server_slice_equals(request->version, "HTTP/1.1");
+    }
+    // The server never reads request bodies, so their bytes would be parsed as the next
+    // pipelined request. Close instead of reusing such a connection.
+    Slice *contentLength = http_server_get_header(request, "Content-Length");
+    if ((contentLength != NULL && !http_server_slice_equals(*contentLength, "0")) ||
+        http_server_get_header(request, "Transfer-Encoding") != NULL) {
+        keepAlive = false;
+    }
+    if (requests_served >= config.max_requests || config.keepalive_timeout == 0) {
+        keepAlive = false;
+    }
+
+    if (!keepAlive) {
+        http_server_add_header(response, "Connection", "close");
+        return false;
+    }
+
+    char keepAliveValue[64];
+    sprintf(keepAliveValue, "timeout=%d, max=%d", config.keepalive_timeout,
+            config.max_requests - requests_served);
+    http_server_add_header(response, "Connection", "keep-alive");
+    http_server_add_header(response, "Keep-Alive", keepAliveValue);
+    return true;
+}
+
+/*
+Description:
+    Find the quality a client gave a content coding in an Accept-Encoding value such as
+    "gzip;q=0.8, br, *;q=0". A coding that is not listed gets the quality of "*", if present.
+Arguments:
+    Slice value: The Accept-Encoding header value.
+    const char *coding: The content coding to look up, case-insensitive.
+Return value:
+    Returns the quality, from 0 (not acceptable) to 1.
+*/
+static double accepted_quality(Slice value, const char *coding) {
+    const char *c = value.data;
+    const char *end = value.data + value.length;
+    double wildcard = 0;
+
+    while (c < end) {
+        while (c < end && (*c == ' ' || *c == '\t' || *c == ','))
+            c++;
+        Slice name = {c, 0};
+        while (c < end && *c != ',' && *c != ';' && *c != ' ' && *c != '\t')
+            c++;
+        name.length = c - name.data;
+
+        double quality = 1;
+        while (c < end && *c != ',') {
+            if (*c != ';') {
+                c++;
+                continue;
+            }
+            c++;
+            while (c < end && (*c == ' ' || *c == '\t'))
+                c++;
+            if (end - c < 2 || (*c != 'q' && *c != 'Q') || c[1] != '=')
+                continue;
+            // qvalue = ( "0" [ "." 0*3DIGIT ] ) / ( "1" [ "." 0*3("0") ] )
+            c += 2;
+            quality = 0;
+            while (c < end && *c >= '0' && *c <= '9')
+                quality = quality * 10 + (*c++ - '0');
+            if (c < end && *c == '.') {
+                c++;
+                for (double scale = 0.1; c < end && *c >= '0' && *c <= '9'; scale /= 10)
+                    quality += (*c++ - '0') * scale;
+            }
+        }
+
+        if (http_server_slice_equals_ignore_case(name, coding)) {
+            return quality;
+        }
+        if (http_server_slice_equals(name, "*")) {
+            wildcard = quality;
+        }
+    }
+    return wildcard;
+}
+
+// Precompressed variants looked for next to a served file, in order of preference when the
+// client accepts several equally.
+static const struct {
+    const char *suffix;
+    const char *coding;
+} precompressedVariants[] = {
+    {".br", "br"},
+    {".gz", "gzip"},
+};
+
+/*
+Description:
+    Pick the best precompressed variant of a file, such as page.html.br or page.html.gz, that the
+    client accepts. Variants older than the file are ignored.
+Arguments:
+    Slice *accept_encoding: The Accept-Encoding header, or NULL if the request has none.
+    const char *full_path: The path of the file.
+    time_t mtime: The modification time of the file.
+    const char **coding: Set to the content coding of the variant returned.
+    bool *exists: Set to true if there is any usable variant, accepted or not.
+Return value:
+    Returns the variant with a reference held, or NULL if the client accepts none of them.
+*/
+static FdEntry *find_precompressed(Slice *accept_encoding, const char *full_path, time_t mtime,
+                                   const char **coding, bool *exists) {
+    char variantPath[strlen(full_path) + 4];
+    FdEntry *best = NULL;
+    double bestQuality = 0;
+
+    for (size_t i = 0; i < sizeof(precompressedVariants) / sizeof(precompressedVariants[0]); i++) {
+        // Missing variants are cached as negative fd cache entries, so probing is cheap.
+        sprintf(variantPath, "%s%s", full_path, precompressedVariants[i].suffix);
+        FdEntry *variant = fd_cache_acquire(variantPath);
+        if (variant == NULL) {
+            continue;
+        }
+        if (variant->mtime < mtime) {
+            fd_cache_release(variant);
+            continue;
+        }
+        *exists = true;
+
+        double quality = accept_encoding == NULL
+                             ? 0
+                             : accepted_quality(*accept_encoding, precompressedVariants[i].coding);
+        if (quality > bestQuality) {
+            if (best != NULL) {
+                fd_cache_release(best);
+            }
+            best = variant;
+            *coding = precompressedVariants[i].coding;
+            bestQuality = quality;
+        } else {
+            fd_cache_release(variant);
+        }
+    }
+    return best;
+}
+
+/*
+Description:
+    Pick the representation of a file the client gets, from the fd cache's metadata alone so
+    nothing is read before conditionals are checked. A precompressed variant next to the file
+    that the client accepts is swapped into response->file. Otherwise text files of at least
+    config.gzip_min_size bytes that fit in the file cache are marked to be gzipped on the fly,
+    which load_body does. Adds Vary whenever the body could have been compressed, since then the
+    response depends on Accept-Encoding.
+Arguments:
+    Request *request: The request being answered.
+    const char *full_path: The path of the file the response holds.
+    Config config: The server configuration.
+    Response *response: The response, with its fd cache entry set.
+    const char **coding: Set to the content coding of a precompressed variant, or left alone.
+    bool *gzip: Set to whether the body should be gzipped on the fly.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+static int negotiate_encoding(Request *request, const char *full_path, Config config,
+                              Response *response, const char **coding, bool *gzip) {
+    Slice *acceptEncoding = http_server_get_header(request, "Accept-Encoding");
+    FdEntry *file = response->file;
+    bool varies = false;
+
+    FdEntry *variant = find_precompressed(acceptEncoding, full_path, file->mtime, coding, &varies);
+    if (variant != NULL) {
+        fd_cache_release(file);
+        response->file = variant;
+    } else if (config.gzip_min_size > 0 && file->size >= config.gzip_min_size &&
+               file->mime->compressible && file_cache_fits((size_t)file->size)) {
+        varies = true;
+        *gzip = acceptEncoding != NULL && accepted_quality(*acceptEncoding, "gzip") > 0;
+    }
+
+    if (varies) {
+        return http_server_add_header(response, "Vary", "Accept-Encoding");
+    }
+    return 0;
+}
+
+// The version of a file a response body comes from, which its validators are made from.
+typedef struct BodyVersion {
+    ino_t inode;
+    unsigned long size; // Of the file, before any compression on the fly.
+    time_t mtime;
+    bool gzip; // Compressed on the fly.
+} BodyVersion;
+
+/*
+Description:
+    Work out the strong ETag of a response body from the inode, size and modification time of
+    the file it comes from. Bodies compressed on the fly get the coding appended, so they never
+    share an ETag with the file itself, but their ETag is still known before compressing.
+Arguments:
+    const BodyVersion *version: The version of the file.
+    char *etag: Filled in with the quoted ETag. Has room for HTTP_SERVER_MAX_ETAG bytes.
+Return value:
+    None
+*/
+static void body_validators(const BodyVersion *version, char *etag) {
+    sprintf(etag, "\"%lx-%lx-%lx%s\"", (unsigned long)version->inode, version->size,
+            (unsigned long)version->mtime, version->gzip ? "-gzip" : "");
+}
+
+/*
+Description:
+    Give a HEAD response the gzip body a GET would send, if one has already been made for this
+    version of the file, so both report the same Content-Length and ETag. HEAD never reads or
+    compresses the file itself; until a GET has compressed it, HEAD describes the identity body.
+Arguments:
+    Response *response: The response, holding the fd cache entry of its body.
+    BodyVersion *version: What the validators were made from. gzip is cleared if there is no
+        compressed body to report.
+Return value:
+    None
+*/
+static void find_compressed_body(Response *response, BodyVersion *version) {
+    if (!version->gzip) {
+        return;
+    }
+    FdEntry *file = response->file;
+    CacheEntry *compressed = file_cache_find_gzip(file->path, file->inode, file->mtime);
+    // load_body keeps a compressed body only when it is smaller, and so does this.
+    if (compressed == NULL || compressed->size >= (size_t)file->size) {
+        if (compressed != NULL) {
+            file_cache_release(compressed);
+        }
+        version->gzip = false;
+        return;
+    }
+    fd_cache_release(file);
+    response->file = NULL;
+    response->cache_entry = compressed;
+}
+
+/*
+Description:
+    Read the body of a GET response into memory when the file cache will hold it, and gzip it
+    when negotiate_encoding asked for that and it comes out smaller. Otherwise the body stays
+    with the fd cache entry and is sent from the file.
+Arguments:
+    Response *response: The response, holding the fd cache entry of its body.
+    BodyVersion *version: What the validators were made from. Updated to the version that was
+        read, and gzip cleared if the body was not compressed after all.
+Return value:
+    None
+*/
+static void load_body(Response *response, BodyVersion *version) {
+    // A file the cache won't hold is sent from the fd cache entry without opening it again.
+    CacheEntry *source = NULL;
+    if (file_cache_fits((size_t)response->file->size)) {
+        source = file_cache_acquire(response->file->path);
+    }
+    if (source == NULL) {
+        // Too big for the cache, or the cache is off: only cached files are compressed.
+        version->gzip = false;
+        return;
+    }
+    fd_cache_release(response->file);
+    response->file = NULL;
+    response->cache_entry = source;
+    version->inode = source->inode;
+    version->size = source->size;
+    version->mtime = source->mtime;
+    if (!version->gzip) {
+        return;
+    }
+
+    CacheEntry *compressed = file_cache_acquire_gzip(source);
+    if (compressed != NULL && compressed->size < source->size) {
+        file_cache_release(source);
+        response->cache_entry = compressed;
+        return;
+    }
+    if (compressed != NULL) {
+        file_cache_release(compressed);
+    }
+    version->gzip = false;
+}
+
+/*
+Description:
+    Check whether an If-None-Match value such as "W/\"a\", \"b\"" or "*" lists an ETag. The
+    comparison is weak: a W/ prefix is ignored.
+Arguments:
+    Slice value: The If-None-Match header value.
+    const char *etag: The quoted ETag of the current body.
+Return value:
+    Returns true if the ETag is in the list.
+*/
+static bool etag_listed(Slice value, const char *etag) {
+    const char *c = value.data;
+    const char *end = value.data + value.length;
+    size_t etagLength = strlen(etag);
+
+    while (c < end) {
+        while (c < end && (*c == ' ' || *c == '\t' || *c == ','))
+            c++;
+        if (c < end && *c == '*')
+            return true;
+        if (end - c >= 2 && c[0] == 'W' && c[1] == '/')
+            c += 2;
+        const char *tag = c;
+        if (c < end && *c == '"') {
+            c++;
+            while (c < end && *c != '"')
+                c++;
+            c++;
+        }
+        if (c > end)
+            break;
+        if ((size_t)(c - tag) == etagLength && memcmp(tag, etag, etagLength) == 0)
+            return true;
+        while (c < end && *c != ',')
+            c++;
+    }
+    return false;
+}
+
+/*
+Description:
+    Parse an HTTP date, in the IMF-fixdate form "Sun, 06 Nov 1994 08:49:37 GMT" or either of the
+    obsolete RFC 850 and asctime forms.
+Arguments:
+    Slice value: The date.
+    time_t *when: Set to the time it stands for.
+Return value:
+    Returns true if the date could be parsed.
+*/
+static bool parse_http_date(Slice value, time_t *when) {
+    static const char *formats[] = {"%a, %d %b %Y %H:%M:%S GMT", "%A, %d-%b-%y %H:%M:%S GMT",
+                                    "%a %b %e %H:%M:%S %Y"};
+    char date[64];
+
+    if (value.length >= sizeof date) {
+        return false;
+    }
+    memcpy(date, value.data, value.length);
+    date[value.length] = '\0';
+
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm fields;
+        memset(&fields, 0, sizeof fields);
+        const char *end = strptime(date, formats[i], &fields);
+        if (end != NULL && *end == '\0') {
+            *when = timegm(&fields);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+Description:
+    Evaluate If-None-Match, or If-Modified-Since when there is no If-None-Match, against the
+    current body.
+Arguments:
+    Request *request: The request being answered.
+    const char *etag: The quoted ETag of the body.
+    time_t mtime: The modification time of the body.
+Return value:
+    Returns true if the client's copy is current and a 304 should be sent instead.
+*/
+static bool not_modified(Request *request, const char *etag, time_t mtime) {
+    Slice *ifNoneMatch = http_server_get_header(request, "If-None-Match");
+    Slice *ifModifiedSince = http_server_get_header(request, "If-Modified-Since");
+    time_t since;
+
+    if (ifNoneMatch != NULL) {
+        return etag_listed(*ifNoneMatch, etag);
+    }
+    return ifModifiedSince != NULL && parse_http_date(*ifModifiedSince, &since) &&
+           mtime <= since;
+}
+
+// An inclusive byte range of a response body.
+typedef struct ByteRange {
+    unsigned long first;
+    unsigned long last;
+} ByteRange;
+
+static unsigned long boundaryCounter;
+
+/*
+Description:
+    Read a run of decimal digits. Values too big for an unsigned long saturate.
+Arguments:
+    const char **c: The position to read from; moved past the digits.
+    const char *end: The end of the input.
+    unsigned long *value: Set to the number read.
+Return value:
+    Returns true if there was at least one digit.
+*/
+static bool parse_number(const char **c, const char *end, unsigned long *value) {
+    const char *start = *c;
+
+    *value = 0;
+    for (; *c < end && **c >= '0' && **c <= '9'; (*c)++) {
+        unsigned long digit = **c - '0';
+        *value = *value > (ULONG_MAX - digit) / 10 ? ULONG_MAX : *value * 10 + digit;
+    }
+    return *c != start;
+}
+
+/*
+Description:
+    Parse a Range header value such as "bytes=0-499, 1000-, -500" against a body of size bytes.
+    Open ends are clamped to the body, and ranges that start past its end are left out.
+Arguments:
+    Slice value: The Range header value.
+    unsigned long size: The length of the whole body.
+    ByteRange *ranges: Filled in with the satisfiable ranges, in the order they were asked for.
+        Has room for HTTP_SERVER_MAX_RANGES.
+Return value:
+    Returns the number of satisfiable ranges, which is 0 if none are, or -1 if the header should
+    be ignored: it is malformed, uses a unit other than bytes or asks for too many ranges.
+*/
+static int parse_range(Slice value, unsigned long size, ByteRange *ranges) {
+    const char *c = value.data;
+    const char *end = value.data + value.length;
+    int numSpecs = 0;
+    int numRanges = 0;
+
+    if (value.length < 6 || strncasecmp(c, "bytes=", 6) != 0) {
+        return -1;
+    }
+    c += 6;
+
+    while (c < end) {
+        while (c < end && (*c == ' ' || *c == '\t' || *c == ','))
+            c++;
+        if (c == end)
+            break;
+
+        unsigned long first;
+        unsigned long last;
+        bool hasFirst = parse_number(&c, end, &first);
+        if (c == end || *c != '-')
+            return -1;
+        c++;
+        bool hasLast = parse_number(&c, end, &last);
+        while (c < end && (*c == ' ' || *c == '\t'))
+            c++;
+        if ((c < end && *c != ',') || (!hasFirst && !hasLast) ||
+            (hasFirst && hasLast && last < first))
+            return -1;
+        if (++numSpecs > HTTP_SERVER_MAX_RANGES)
+            return -1;
+
+        if (!hasFirst) {
+            // "-500" is the last 500 bytes.
+            if (last == 0 || size == 0)
+                continue;
+            first = last >= size ? 0 : size - last;
+            last = size - 1;
+        } else if (first >= size) {
+            continue;
+        } else if (!hasLast || last >= size) {
+            last = size - 1;
+        }
+        ranges[numRanges].first = first;
+        ranges[numRanges].last = last;
+        numRanges++;
+    }
+    return numSpecs == 0 ? -1 : numRanges;
+}
+
+/*
+Description:
+    Narrow a 200 response down to the ranges its request asks for. One range becomes a 206 with
+    Content-Range. Several become a 206 multipart/byteranges body whose part headers are literal
+    body parts around slices of the file, so the slices are still sent straight from the file
+    or cache. Ranges that all start past the end of the body get a 416. Malformed Range headers
+    are ignored, and so is the Range of a request whose If-Range no longer matches the body.
+Arguments:
+    Request *request: The request being answered.
+    Response *response: The response, with one body part covering the whole body.
+    const char *etag: The quoted ETag of the body.
+    time_t mtime: The modification time of the body.
+    const char *content_type: The type of the body, repeated in each part of a multipart body.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+static int apply_range(Request *request, Response *response, const char *etag, time_t mtime,
+                       const char *content_type) {
+    Slice *range = http_server_get_header(request, "Range");
+    Slice *ifRange = http_server_get_header(request, "If-Range");
+    unsigned long size = response->content_length;
+    ByteRange ranges[HTTP_SERVER_MAX_RANGES];
+    char value[256];
+    time_t since;
+
+    if (http_server_add_header(response, "Accept-Ranges", "bytes")) {
+        return 1;
+    }
+    // If-Range compares strongly: the ETag exactly, or a date equal to the modification time.
+    if (ifRange != NULL && !http_server_slice_equals(*ifRange, etag) &&
+        !(parse_http_date(*ifRange, &since) && since == mtime)) {
+        range = NULL;
+    }
+    int numRanges = range == NULL ? -1 : parse_range(*range, size, ranges);
+    if (numRanges == -1) {
+        return 0;
+    }
+
+    if (numRanges == 0) {
+        response->status = arena_strdup(response->arena, "416");
+        response->num_parts = 0;
+        response->content_length = 0;
+        sprintf(value, "bytes */%lu", size);
+        return response->status == NULL ||
+               http_server_add_header(response, "Content-Range", value);
+    }
+    if ((response->status = arena_strdup(response->arena, "206")) == NULL) {
+        return 1;
+    }
+
+    if (numRanges == 1) {
+        response->parts[0].offset = ranges[0].first;
+        response->parts[0].length = ranges[0].last - ranges[0].first + 1;
+        response->content_length = response->parts[0].length;
+        sprintf(value, "bytes %lu-%lu/%lu", ranges[0].first, ranges[0].last, size);
+        return http_server_add_header(response, "Content-Range", value);
+    }
+
+    // The boundary only has to be unlikely to appear in the body.
+    char boundary[17];
+    uint64_t seed = timer_wheel_now_ms() * 0x9E3779B97F4A7C15ULL ^
+                    __atomic_add_fetch(&boundaryCounter, 1, __ATOMIC_RELAXED);
+    sprintf(boundary, "%016llx", (unsigned long long)seed);
+
+    // A part header before each slice, then the closing delimiter.
+    BodyPart *parts = arena_alloc(response->arena, sizeof(BodyPart) * (2 * numRanges + 1));
+    if (parts == NULL) {
+        return 1;
+    }
+    response->content_length = 0;
+    for (int i = 0; i < numRanges; i++) {
+        snprintf(value, sizeof value,
+                 "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lu-%lu/%lu\r\n\r\n",
+                 boundary, content_type, ranges[i].first, ranges[i].last, size);
+        if ((parts[2 * i].data = arena_strdup(response->arena, value)) == NULL) {
             return 1;
+        }
+        parts[2 * i].length = strlen(value);
+        parts[2 * i + 1].data = NULL;
+        parts[2 * i + 1].offset = ranges[i].first;
+        parts[2 * i + 1].length = ranges[i].last - ranges[i].first + 1;
+        response->content_length += parts[2 * i].length + parts[2 * i + 1].length;
+    }
+    sprintf(value, "\r\n--%s--\r\n", boundary);
+    if ((parts[2 * numRanges].data = arena_strdup(response->arena, value)) == NULL) {
+        return 1;
+    }
+    parts[2 * numRanges].length = strlen(value);
+    response->content_length += parts[2 * numRanges].length;
+    response->parts = parts;
+    response->num_parts = 2 * numRanges + 1;
+
+    sprintf(value, "multipart/byteranges; boundary=%s", boundary);
+    return http_server_add_header(response, "Content-Type", value);
+}
+
+/*
+Description:
+    Answer with one of the preloaded error responses.
+Arguments:
+    Response *response: The response to fill in.
+    int status: The status code, which must have an entry in errorPages.
+    bool head: Whether the request is a HEAD request.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+static int use_error_page(Response *response, int status, bool head) {
+    for (size_t i = 0; i < sizeof(errorPages) / sizeof(errorPages[0]); i++) {
+        if (errorPages[i].status == status && errorPages[i].response.data[0] != NULL) {
+            char statusString[10];
+            sprintf(statusString, "%d", status);
+            response->canned = &errorPages[i].response;
+            response->head = head;
+            response->status = arena_strdup(response->arena, statusString);
+            return response->status == NULL;
+        }
+    }
+    log_error("No error page for %d. Were the error pages loaded?", status);
+    return 1;
+}
+
+/*
+Description:
+    Answer with the server's metrics in the Prometheus text format.
+Arguments:
+    Response *response: The response to fill in.
+    bool head: Whether the request is a HEAD request.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+static int serve_metrics(Response *response, bool head) {
+    char lengthString[32];
+    size_t length;
+
+    char *text = metrics_render(response->arena, &length);
+    if (text == NULL ||
+        (response->parts = arena_alloc(response->arena, sizeof(BodyPart))) == NULL ||
+        (response->status = arena_strdup(response->arena, "200")) == NULL) {
+        return 1;
+    }
+    response->parts[0].data = text;
+    response->parts[0].offset = 0;
+    response->parts[0].length = length;
+    response->num_parts = head ? 0 : 1;
+    response->content_length = head ? 0 : length;
+
+    sprintf(lengthString, "%zu", length);
+    return http_server_add_header(response, "Content-Type",
+                                  "text/plain; version=0.0.4; charset=utf-8") ||
+           http_server_add_header(response, "Cache-Control", "no-store") ||
+           http_server_add_header(response, "Content-Length", lengthString);
+}
+
+/*
+Description:
+    Let go of the file or cache entry of a response whose body will not be sent, and empty the
+    body.
+Arguments:
+    Response *response: The response.
+Return value:
+    None
+*/
+static void release_body(Response *response) {
+    if (response->cache_entry != NULL) {
+        file_cache_release(response->cache_entry);
+    } else if (response->file != NULL) {
+        fd_cache_release(response->file);
+    }
+    response->cache_entry = NULL;
+    response->file = NULL;
+    response->num_parts = 0;
+    response->content_length = 0;
+}
+
+/*
+Description:
+    Convert a Request struct into a Response struct. The request path is resolved through the
+    path cache, so nothing outside the served folder is ever opened. The status and headers are
+    allocated from response->arena, which must be set. The file or cache entry the response holds
+    must be released using http_server_client_cleanup. A HEAD request gets the headers a GET
+    would, worked out from the fd cache's metadata; the file is never read and the response has
+    no body. Conditional requests are checked against the same metadata, so a 304 never reads
+    the file either.
+Arguments:
+    Request *request: The request struct that will be processed.
+    Config config: The server configuration, with the folder to serve the files from.
+    Response *response: The response struct that will be filled in.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+int http_server_process_request(Request *request, Config config, Response *response) {
+
+    FdEntry *myFile = NULL;
+    char fileLengthString[100];
+
+    bool head = http_server_slice_equals(request->method, "HEAD");
+    if (!http_server_slice_equals(request->method, "GET") && !head) {
+        log_error("Method Not Allowed");
+        return use_error_page(response, 405, false);
+    }
+    size_t metricsPathLength = strlen(HTTP_SERVER_METRICS_PATH);
+    if (config.metrics && request->path.length >= metricsPathLength &&
+        strncmp(request->path.data, HTTP_SERVER_METRICS_PATH, metricsPathLength) == 0 &&
+        (request->path.length == metricsPathLength ||
+         request->path.data[metricsPathLength] == '?')) {
+        return serve_metrics(response, head);
+    }
+
+    char *fullPath = path_cache_resolve(request->path.data, request->path.length,
+                                        response->arena);
+    if (fullPath == NULL) {
+        log_error("Could not resolve path.");
+        return use_error_page(response, 404, head);
+    }
+    // Everything up to the conditional check works on the fd cache's metadata, so a client that
+    // already has the body is answered without reading the file.
+    if ((myFile = fd_cache_acquire(fullPath)) == NULL) {
         log_error("Could not open file.");
-        sprintf(status, "%d", 404);
-        response->status = calloc(1, 10);
-        memcpy(response->status, status, strlen(status));
+        return use_error_page(response, 404, head);
     }
-    response->file = malloc(sizeof(FILE *));
     response->file = myFile;
+    if ((response->status = arena_strdup(response->arena, "200")) == NULL) {
+        return 1;
+    }
+    // Taken before negotiation, which may swap in a precompressed variant with its own extension.
+    const MimeType *mime = myFile->mime;
+    const char *coding = NULL;
+    bool gzip = false;
+    if (negotiate_encoding(request, fullPath, config, response, &coding, &gzip)) {
+        return 1;
+    }
+
+    BodyVersion version = {response->file->inode, (unsigned long)response->file->size,
+                           response->file->mtime, gzip};
+    char etag[HTTP_SERVER_MAX_ETAG];
+    body_validators(&version, etag);
+    bool notModified = not_modified(request, etag, version.mtime);
+    if (!notModified) {
+        if (!head) {
+            load_body(response, &version);
+        } else {
+            find_compressed_body(response, &version);
+        }
+        // The body may not be the one the validators were predicted from: it changed on disk
+        // since the fd cache looked, or would not compress. Check again against what is sent.
+        char loadedEtag[HTTP_SERVER_MAX_ETAG];
+        body_validators(&version, loadedEtag);
+        if (strcmp(loadedEtag, etag) != 0) {
+            strcpy(etag, loadedEtag);
+            notModified = not_modified(request, etag, version.mtime);
+        }
+    }
 
-    // Get size of file
-    fseek(response->file, 0, SEEK_END);
-    unsigned long file_length = (unsigned long)ftell(response->file);
-    // Go back to the beginning
-    fseek(response->file, 0, SEEK_SET);
-
-    // Set header name and value
-    response->headers = malloc(sizeof(Header *));
-    response->headers[0] = malloc(sizeof(Header));
-    response->headers[0]->name = calloc(1, 15);
-    memcpy(response->headers[0]->name, "Content-Length", 14);
-    sprintf(fileLengthString, "%lu", file_length);
-    response->headers[0]->value = malloc(strlen(fileLengthString) + 1);
-    memcpy(response->headers[0]->value, fileLengthString, strlen(fileLengthString));
-    response->headers[0]->value[strlen(fileLengthString)] = '\0';
-
-    // For now I will only deal with one header.
-    response->num_headers = 1;
+    char lastModified[64];
+    struct tm fields;
+    strftime(lastModified, sizeof lastModified, "%a, %d %b %Y %H:%M:%S GMT",
+             gmtime_r(&version.mtime, &fields));
+    if (http_server_add_header(response, "ETag", etag) ||
+        http_server_add_header(response, "Last-Modified", lastModified)) {
+        return 1;
+    }
+    if (notModified) {
+        // The body is never sent, so let go of it now.
+        release_body(response);
+        response->status = arena_strdup(response->arena, "304");
+        return response->status == NULL;
+    }
+    if (version.gzip) {
+        coding = "gzip";
+    }
+    if (coding != NULL && http_server_add_header(response, "Content-Encoding", coding)) {
+        return 1;
+    }
+
+    // The body is the whole file unless a range narrows it down.
+    if ((response->parts = arena_alloc(response->arena, sizeof(BodyPart))) == NULL) {
+        return 1;
+    }
+    response->parts[0].data = NULL;
+    response->parts[0].offset = 0;
+    if (response->cache_entry != NULL) {
+        response->parts[0].length = response->cache_entry->size;
+    } else {
+        response->parts[0].length = (unsigned long)response->file->size;
+    }
+    response->num_parts = 1;
+    response->content_length = response->parts[0].length;
+
+    // Range only applies to GET; a HEAD response just advertises it.
+    if (head && http_server_add_header(response, "Accept-Ranges", "bytes")) {
+        return 1;
+    }
+    if (!head && apply_range(request, response, etag, version.mtime, mime->type)) {
+        return 1;
+    }
+    // A multipart body carries its own Content-Type and a 416 has no body.
+    if (response->num_parts == 1 && http_server_add_header(response, "Content-Type", mime->type)) {
+        return 1;
+    }
+
+    sprintf(fileLengthString, "%lu", response->content_length);
+    if (http_server_add_header(response, "Content-Length", fileLengthString)) {
+        return 1;
+    }
+    if (head) {
+        release_body(response);
+    }
     return 0;
 }
\ No newline at end of file
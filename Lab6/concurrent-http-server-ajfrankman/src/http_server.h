@@ -13,17 +13,59 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "access_log.h"
+#include "arena.h"
+#include "fd_cache.h"
+#include "file_cache.h"
+#include "metrics.h"
+#include "path_cache.h"
+#include "timer_wheel.h"
+
 #define HTTP_SERVER_DEFAULT_PORT "8085"
 #define HTTP_SERVER_DEFAULT_RELATIVE_PATH "."
 #define HTTP_SERVER_BAD_SOCKET -1
 #define HTTP_SERVER_BACKLOG 10
 #define HTTP_SERVER_HTTP_VERSION "HTTP/1.1"
 #define HTTP_SERVER_MAX_HEADER_SIZE 512
+#define HTTP_SERVER_MAX_HEADERS 32
+#define HTTP_SERVER_MAX_RANGES 16
+#define HTTP_SERVER_MAX_ETAG 80
 #define HTTP_SERVER_FILE_CHUNK 1024
+#define HTTP_SERVER_RECV_CHUNK 4096
+#define HTTP_SERVER_MAX_REQUEST_SIZE (16 * 1024)
+#define HTTP_SERVER_POOL_THREADS_PER_CORE 8
+#define HTTP_SERVER_DEFAULT_QUEUE_DEPTH 256
+#define HTTP_SERVER_DEFAULT_KEEPALIVE_TIMEOUT 5
+#define HTTP_SERVER_DEFAULT_HEADER_TIMEOUT 10
+#define HTTP_SERVER_DEFAULT_REQUEST_TIMEOUT 60
+#define HTTP_SERVER_DEFAULT_MAX_REQUESTS 100
+#define HTTP_SERVER_DEFAULT_CACHE_MB 32
+#define HTTP_SERVER_DEFAULT_STAT_INTERVAL_MS 1000
+#define HTTP_SERVER_DEFAULT_GZIP_MIN_SIZE 1024
+// Answered with the server's metrics instead of a file when --metrics is given.
+#define HTTP_SERVER_METRICS_PATH "/__metrics"
+
+// Return values of the non-blocking connection functions. HTTP_SERVER_IO_AGAIN means the socket
+// would block and the function should be called again once it is readable/writable.
+#define HTTP_SERVER_IO_DONE 0
+#define HTTP_SERVER_IO_ERROR 1
+#define HTTP_SERVER_IO_AGAIN 2
+
+// How client connections are handed out to threads.
+typedef enum ConcurrencyMode {
+    MODE_POOL,      // A fixed pool of blocking worker threads fed by a bounded socket queue.
+    MODE_EPOLL,     // A few edge-triggered epoll event loops driving non-blocking connections.
+    MODE_REUSEPORT, // Epoll event loops that each accept on their own SO_REUSEPORT listener.
+    MODE_URING,     // io_uring rings that batch every socket and file operation.
+} ConcurrencyMode;
 
 // Contains all of the information needed to create to connect to the server and
 // send it a message.
@@ -31,6 +73,19 @@ typedef struct Config {
     char *port;
     char *relative_path;
     bool delay;
+    ConcurrencyMode mode;
+    int num_threads;
+    bool pin_threads; // Pin event loop i to core i.
+    int queue_depth;
+    int keepalive_timeout; // Seconds an idle keep-alive connection is held open.
+    int header_timeout;    // Seconds a client has to send a whole request header block.
+    int request_timeout;   // Seconds a request may take from its first byte to its last.
+    int max_requests;      // Requests answered on one connection before it is closed.
+    int cache_mb;          // Budget of the in-memory file cache.
+    int stat_interval_ms;  // How long an open file is served before it is checked for changes.
+    int gzip_min_size;     // Smallest file compressed on the fly, in bytes. 0 disables it.
+    bool metrics;          // Serve HTTP_SERVER_METRICS_PATH.
+    char *access_log;      // File each request is logged to, or NULL for none.
 } Config;
 
 typedef struct Header {
@@ -38,20 +93,122 @@ typedef struct Header {
     char *value;
 } Header;
 
+// A view into the connection's receive buffer. It is not NUL-terminated and is only valid until
+// the connection reads its next request.
+typedef struct Slice {
+    const char *data;
+    size_t length;
+} Slice;
+
+typedef struct HeaderSlice {
+    Slice name;
+    Slice value;
+} HeaderSlice;
+
+// Parsing fills in views of the header block, so a Request owns no memory of its own.
 typedef struct Request {
-    char *method;
-    char *path;
+    Slice method;
+    Slice path;
+    Slice version;
     int num_headers;
-    Header **headers;
+    HeaderSlice headers[HTTP_SERVER_MAX_HEADERS];
 } Request;
 
+// A piece of a response body: a slice of the file or cache entry, or literal bytes such as the
+// part headers of a multipart/byteranges body.
+typedef struct BodyPart {
+    const char *data;     // Literal bytes in the arena, or NULL for a slice of the file.
+    unsigned long offset; // Where the slice starts in the file.
+    unsigned long length;
+} BodyPart;
+
+// A complete error response, status line to body, serialized once at startup by
+// http_server_load_error_pages. There is one copy for a connection that is kept alive after it
+// and one for a connection that is closed.
+typedef struct CannedResponse {
+    char *data[2]; // Indexed by keep_alive.
+    size_t length[2];
+    size_t body_length;
+} CannedResponse;
+
+// The status, headers and serialized head are allocated from arena, which belongs to the
+// connection and is reset between requests; only file and cache_entry need releasing.
 typedef struct Response {
+    Arena *arena;
     char *status;
-    FILE *file;
+    FdEntry *file;           // Shared with other responses; read it at explicit offsets only.
+    CacheEntry *cache_entry; // Set instead of file when the body is served from memory.
+    BodyPart *parts;         // The body, in order. Usually one slice covering the whole file.
+    int num_parts;
+    unsigned long content_length; // The total length of parts.
+    const CannedResponse *canned; // Sent instead of all of the above for preloaded errors.
+    bool head;                    // Answering HEAD, so a canned response's body is left out.
     int num_headers;
+    int header_cap;
     Header **headers;
 } Response;
 
+typedef enum ConnectionState {
+    CONN_READING, // Waiting for a complete request header block.
+    CONN_WRITING, // Sending the status line, headers and body.
+    CONN_DONE,    // The response has been sent and the connection can be closed.
+} ConnectionState;
+
+// Everything needed to drive one client through receive -> process -> send without blocking. The
+// event loop keeps one of these per socket and calls back into it every time epoll reports the
+// socket is ready.
+typedef struct Connection {
+    int socket;
+    ConnectionState state;
+
+    // Bytes received so far. scan_pos is where the search for the end of the header block
+    // resumes so that every recv() only looks at the new bytes. request_len is the size of the
+    // header block being answered; bytes after it belong to the next pipelined request.
+    char *recv_buf;
+    size_t recv_len;
+    size_t recv_cap;
+    size_t scan_pos;
+    size_t request_len;
+
+    Request request;
+    Response response;
+    Arena *arena; // Request-scoped allocations, reset by http_server_connection_reset.
+
+    // Serialized status line and headers (in the arena), then the body parts. body_sent counts
+    // across all of them. File slices go out with sendfile unless that is unsupported, in which
+    // case they are copied one chunk at a time.
+    char *send_buf;
+    size_t send_len;
+    size_t send_pos;
+    bool buffered_body;
+    char *chunk;
+    size_t chunk_len;
+    size_t chunk_pos;
+    unsigned long body_sent;
+    // Backends that queue sends and complete them later (io_uring) keep the iovecs and message
+    // header of the send in flight here, since they must stay valid until it completes.
+    struct iovec send_parts[2];
+    struct msghdr send_message;
+
+    int requests_served;
+    bool keep_alive;
+    // Deadlines, on the timer_wheel_now_ms clock. request_start_ms is 0 while the connection is
+    // idle between requests. The timer is armed by the backend with
+    // http_server_connection_deadline.
+    uint64_t idle_since_ms;
+    uint64_t request_start_ms;
+    Timer timer;
+    // When the current phase of the request began, on the metrics_now_ns clock; 0 while idle.
+    uint64_t phase_start_ns;
+    // When the first byte of the request arrived, on the same clock, and who sent it, for the
+    // access log.
+    uint64_t request_start_ns;
+    AccessLogClient client;
+
+    struct Connection *prev;
+    struct Connection *next;
+} Connection;
+
 /*
 Description:
     Parses the commandline arguments and options given to the program.
@@ -64,13 +221,37 @@ Return value:
 */
 int http_server_parse_arguments(int argc, char *argv[], Config *config);
 
+/*
+Description:
+    Build the error responses (404 and 405) once, so that answering an error never touches the
+    disk. Each page is read from the served folder, such as FOLDER/404.html, and a built-in page
+    is used when the folder has none. Changes to the pages take effect on restart.
+Arguments:
+    const char *folder: The folder files are served from.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+int http_server_load_error_pages(const char *folder);
+
+/*
+Description:
+    Free the error responses built by http_server_load_error_pages.
+Arguments:
+    None
+Return value:
+    None
+*/
+void http_server_free_error_pages(void);
+
 ///////////////////////////////////////////////////////////////////////
 /////////////////////// SOCKET RELATED FUNCTIONS //////////////////////
 ///////////////////////////////////////////////////////////////////////
 
 /*
 Description:
-    Create and bind to a server socket using the provided configuration.
+    Create and bind to a server socket using the provided configuration. In MODE_REUSEPORT the
+    socket is bound with SO_REUSEPORT, so it can be called once per event loop to open several
+    listeners on the same port.
 Arguments:
     Config config: A config struct with the necessary information.
 Return value:
@@ -91,38 +272,38 @@ int http_server_accept(int socket);
 
 /*
 Description:
-    Read data from the provided client socket, parse the data, and fill in the Request struct.
-    The buffers contained in the Request struct must be freed using http_server_client_cleanup.
+    Read the next request from a blocking client connection into conn->request. Data is pulled
+    into the connection's receive buffer with large recv() calls, and anything read past the end
+    of the request is kept for the next call. conn->request points into that buffer, so it is
+    only valid until http_server_connection_reset.
 Arguments:
-    int socket: The client socket to read from.
-    Request* request: The request struct that will be filled in.
+    Connection *conn: The client connection to read from.
 Return value:
-    Returns a 1 on failure, 0 on success.
+    Returns a 1 on failure or if the socket was shut down, 0 on success.
 */
-int http_server_receive_request(int socket, Request *request);
+int http_server_receive_request(Connection *conn);
 
 /*
 Description:
-    Sends the provided Response struct on the provided client socket.
+    Sends conn->response on a blocking client connection.
 Arguments:
-    int socket: The client socket to send the data with.
-    Response response: The struct containing the response data.
+    Connection *conn: The client connection holding the response.
 Return value:
     Returns a 1 on failure, 0 on success.
 */
-int http_server_send_response(int socket, Response response);
+int http_server_send_response(Connection *conn);
 
 /*
 Description:
-    Cleans up allocated resources and sockets.
+    Releases the response's file and cache entry. Everything else in the response
+    lives in the connection's arena.
 Arguments:
-    int socket: The client socket to close.
-    Request request: The strcut to clean up.
+    int socket: The client socket to close, or -1 to leave it open.
     Response response: The struct to clean up.
 Return value:
     Returns a 1 on failure, 0 on success.
 */
-int http_server_client_cleanup(int socket, Request request, Response response);
+int http_server_client_cleanup(int socket, Response response);
 
 /*
 Description:
@@ -134,24 +315,152 @@ Return value:
 */
 int http_server_cleanup(int socket);
 
+///////////////////////////////////////////////////////////////////////
+///////////////////// NON-BLOCKING CONNECTION FUNCTIONS ///////////////
+///////////////////////////////////////////////////////////////////////
+
+/*
+Description:
+    Allocate the state for a newly accepted client socket. The socket may be blocking or
+    non-blocking.
+Arguments:
+    int socket: The client socket.
+Return value:
+    Returns the new Connection or NULL if it could not be allocated.
+*/
+Connection *http_server_connection_create(int socket);
+
+/*
+Description:
+    Parse the next request out of the bytes already in the receive buffer, without touching the
+    socket. If the header block is not complete yet, make sure the buffer has room for more.
+    Backends that do their own I/O append received bytes at conn->recv_buf + conn->recv_len.
+Arguments:
+    Connection *conn: The connection whose receive buffer is parsed.
+Return value:
+    Returns HTTP_SERVER_IO_DONE once a request is parsed into conn->request,
+    HTTP_SERVER_IO_AGAIN if more bytes are needed, in which case conn->recv_buf has room for
+    conn->recv_cap - conn->recv_len - 1 of them, and HTTP_SERVER_IO_ERROR on a size or parse error.
+*/
+int http_server_take_request(Connection *conn);
+
+/*
+Description:
+    Receive as much of the request as the socket has available. Once the whole header block is
+    in, parse it into conn->request.
+Arguments:
+    Connection *conn: The connection to read on.
+Return value:
+    Returns HTTP_SERVER_IO_DONE once a request is parsed, HTTP_SERVER_IO_AGAIN if the socket ran
+    out of data first, and HTTP_SERVER_IO_ERROR on a socket, size or parse error.
+*/
+int http_server_read_request(Connection *conn);
+
+/*
+Description:
+    Serialize the status line and headers of the response into conn->send_buf.
+Arguments:
+    Connection *conn: The connection holding the response.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+int http_server_serialize_response_head(Connection *conn);
+
+/*
+Description:
+    Find the rest of the body part that the next send should start with, given the
+    conn->body_sent bytes of the body already sent.
+Arguments:
+    Connection *conn: The connection holding the response.
+    const char **data: Set to the bytes to send when they are in memory, otherwise to NULL.
+    off_t *offset: Set to where the bytes start in conn->response.file when data is NULL.
+    size_t *length: Set to how many bytes are left in the part.
+Return value:
+    Returns false once the whole body has been sent.
+*/
+bool http_server_next_body_span(Connection *conn, const char **data, off_t *offset,
+                                size_t *length);
+
+/*
+Description:
+    Send as much of conn->response as the socket will take, picking up where the last call left
+    off.
+Arguments:
+    Connection *conn: The connection to write on.
+Return value:
+    Returns HTTP_SERVER_IO_DONE once the whole response is sent, HTTP_SERVER_IO_AGAIN if the
+    socket buffer filled up first, and HTTP_SERVER_IO_ERROR on a socket or file error.
+*/
+int http_server_write_response(Connection *conn);
+
+/*
+Description:
+    Record a response that has been sent in full in the metrics: its status, its size and how
+    long it took to send. http_server_write_response calls it itself; backends that send the
+    response on their own call it once the last byte is out.
+Arguments:
+    Connection *conn: The connection holding the response.
+Return value:
+    None
+*/
+void http_server_response_sent(Connection *conn);
+
+/*
+Description:
+    Work out when a connection should be closed if it makes no further progress. An idle
+    connection gets the keep-alive timeout, or the header timeout before its first request. Once
+    the first bytes of a request arrive, the whole header block has to be in within the header
+    timeout, however slowly it trickles in, and the response has to be sent within the request
+    timeout of that first byte. Call it after every read or write the connection makes.
+Arguments:
+    Connection *conn: The connection.
+    Config config: The server configuration with the timeouts.
+    uint64_t now_ms: The current time from timer_wheel_now_ms.
+Return value:
+    Returns the deadline on the timer_wheel_now_ms clock.
+*/
+uint64_t http_server_connection_deadline(Connection *conn, Config config, uint64_t now_ms);
+
+/*
+Description:
+    Close the client socket and free the connection along with its request and response.
+Arguments:
+    Connection *conn: The connection to destroy.
+Return value:
+    None
+*/
+void http_server_connection_destroy(Connection *conn);
+
+/*
+Description:
+    Free the request and response of a connection that is being kept alive and get it ready to
+    read the next request on the same socket.
+Arguments:
+    Connection *conn: The connection to reset.
+Return value:
+    None
+*/
+void http_server_connection_reset(Connection *conn);
+
 ///////////////////////////////////////////////////////////////////////
 ////////////////////// PROTOCOL RELATED FUNCTIONS /////////////////////
 ///////////////////////////////////////////////////////////////////////
 
-// A helper function to be used inside of http_server_receive_request. This should not be used
+// A helper function to be used inside of http_server_read_request. This should not be used
 // directly in main.c.
 /*
 Description:
-    Converts a string into a request struct. A helper function to be used
-    inside of http_server_receive_request. This should not be used directly
-    in main.c.
+    Converts a header block into a request struct without allocating. The fields of the request
+    point into buf. A helper function to be used inside of http_server_read_request. This should
+    not be used directly in main.c.
 Arguments:
-    char *buf: The string containing the request.
+    const char *buf: The header block, ending with the blank line. It need not be NUL-terminated.
+    size_t length: The length of the header block.
     Request *request: The request struct that will be filled in by buf.
 Return value:
     Returns a 1 on failure, 0 on success.
 */
-int http_server_parse_request(char *buf, Request *request);
+int http_server_parse_request(const char *buf, size_t length, Request *request);
 
 /*
 Description:
@@ -159,12 +468,63 @@ Description:
     buffers to fill in the Response struct. The buffers contained in the Response struct must be
     freeded using http_server_client_cleanup.
 Arguments:
-    Request request: The request struct that will be processed.
-    char *relative_path: The path to server the files from.
+    Request *request: The request struct that will be processed.
+    Config config: The server configuration, with the folder to serve the files from.
     Response *response: The response struct that will be filled in.
 Return value:
     Returns a 1 on failure, 0 on success.
 */
-int http_server_process_request(Request request, char *relative_path, Response *response);
+int http_server_process_request(Request *request, Config config, Response *response);
+
+/*
+Description:
+    Compare a request slice with a string.
+Arguments:
+    Slice slice: The slice to compare.
+    const char *str: The NUL-terminated string to compare it with.
+Return value:
+    Returns true if they are equal. http_server_slice_equals_ignore_case ignores ASCII case.
+*/
+bool http_server_slice_equals(Slice slice, const char *str);
+bool http_server_slice_equals_ignore_case(Slice slice, const char *str);
+
+/*
+Description:
+    Find a request header by name. Header names are case-insensitive.
+Arguments:
+    Request *request: The request to search.
+    const char *name: The header name to look for.
+Return value:
+    Returns the header value, or NULL if the request does not have that header.
+*/
+Slice *http_server_get_header(Request *request, const char *name);
+
+/*
+Description:
+    Append a header to the response. The name and value are copied.
+Arguments:
+    Response *response: The response to add the header to.
+    const char *name: The header name.
+    const char *value: The header value.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+int http_server_add_header(Response *response, const char *name, const char *value);
+
+/*
+Description:
+    Decide whether the connection stays open after this response and add the matching
+    Connection (and Keep-Alive) headers to it. HTTP/1.1 connections persist unless the client
+    sends "Connection: close"; HTTP/1.0 ones only when it asks for keep-alive.
+Arguments:
+    Request *request: The request being answered.
+    Response *response: The response to add the headers to.
+    int requests_served: How many requests this connection has answered, including this one.
+    Config config: The server configuration with the keep-alive limits.
+Return value:
+    Returns true if the connection should be kept open.
+*/
+bool http_server_set_keep_alive(Request *request, Response *response, int requests_served,
+                                Config config);
 
 #endif
@@ -3,15 +3,27 @@
 #include <stdbool.h>
 #include <stdio.h>
 
+#include "arena.h"
+#include "event_loop.h"
+#include "fd_cache.h"
+#include "file_cache.h"
 #include "http_server.h"
 #include "log.h"
+#include "path_cache.h"
+#include "thread_pool.h"
+#include "uring_loop.h"
 
 Config config;
 
-int thread_count;
-pthread_t *threads;
 int mySocket;
-bool running = true;
+volatile bool running = true;
+
+// Pool workers block in recv() and send(), so their deadlines live on one shared wheel. A reaper
+// thread advances it and shuts down the socket of any connection that misses its deadline, which
+// wakes the worker blocked on it.
+TimerWheel poolWheel;
+pthread_mutex_t poolWheelLock = PTHREAD_MUTEX_INITIALIZER;
+volatile bool reaping = true;
 
 void intHandler() {
 
@@ -20,81 +32,154 @@ void intHandler() {
     http_server_cleanup(mySocket);
 }
 
-pthread_t *add_thread(pthread_t *threads[], int *thread_count, int *thread_size) {
-    // If we don't have room, add more space in the threads array
-    if (*thread_count == *thread_size) {
-        *thread_size *= 2; // Double it
-
-        *threads = realloc(*threads, sizeof(**threads) * (*thread_size));
-    }
-
-    pthread_t *new_thread = &(*threads)[*thread_count];
-    (*thread_count)++;
-    return new_thread;
+void arm_timer(Connection *conn) {
+    uint64_t now = timer_wheel_now_ms();
+    pthread_mutex_lock(&poolWheelLock);
+    timer_wheel_schedule(&poolWheel, &conn->timer,
+                         http_server_connection_deadline(conn, config, now));
+    pthread_mutex_unlock(&poolWheelLock);
 }
 
-void *handle_client(void *arg) {
-    int clientSocket = *(int *)arg;
-    Request request;
-    Response response;
+void expire_connection(Timer *timer, void *arg) {
+    (void)arg;
+    log_info("Closing a connection that missed its deadline.");
+    shutdown(((Connection *)timer->data)->socket, SHUT_RDWR);
+}
 
-    if (http_server_receive_request(clientSocket, &request) == 1) {
-        log_error("Receive Error. Cleaning up...");
-        http_server_client_cleanup(clientSocket, request, response);
-        return (void *)0;
+void *reap_connections(void *arg) {
+    (void)arg;
+    while (reaping) {
+        usleep(TIMER_WHEEL_TICK_MS * 1000);
+        pthread_mutex_lock(&poolWheelLock);
+        timer_wheel_advance(&poolWheel, timer_wheel_now_ms(), expire_connection, NULL);
+        pthread_mutex_unlock(&poolWheelLock);
     }
-    sleep(5);
-    if (http_server_process_request(request, config.relative_path, &response) == 1) {
-        log_error("Could not build Response.");
-        http_server_client_cleanup(clientSocket, request, response);
-        return (void *)0;
+    return NULL;
+}
+
+void handle_client(int clientSocket) {
+    Connection *conn = http_server_connection_create(clientSocket);
+    if (conn == NULL) {
+        close(clientSocket);
+        return;
     }
-    if (http_server_send_response(clientSocket, response) == 1) {
-        log_error("Could not send response");
-        http_server_client_cleanup(clientSocket, request, response);
-        return (void *)0;
+
+    // A client that goes quiet, or trickles its request in, gives its worker back once it misses
+    // its deadline.
+    arm_timer(conn);
+    while (running) {
+        if (http_server_receive_request(conn) == 1) {
+            if (conn->requests_served == 0) {
+                log_error("Receive Error. Cleaning up...");
+            }
+            break;
+        }
+        if (config.delay) {
+            sleep(5);
+        }
+        if (http_server_process_request(&conn->request, config, &conn->response) == 1) {
+            log_error("Could not build Response.");
+            break;
+        }
+        conn->requests_served++;
+        conn->keep_alive = http_server_set_keep_alive(&conn->request, &conn->response,
+                                                      conn->requests_served, config);
+        conn->state = CONN_WRITING;
+        arm_timer(conn);
+        if (http_server_send_response(conn) == 1) {
+            break;
+        }
+        if (!conn->keep_alive) {
+            break;
+        }
+        // Free this request but keep the socket, and any pipelined bytes, for the next one.
+        http_server_connection_reset(conn);
+        arm_timer(conn);
     }
-    printf("server: response sent\n");
 
-    http_server_client_cleanup(clientSocket, request, response);
-    free(clientSocket);
-    return (void *)0;
+    // The reaper only touches the connection under the lock, so it is safe to free once the timer
+    // is cancelled.
+    pthread_mutex_lock(&poolWheelLock);
+    timer_wheel_cancel(&conn->timer);
+    pthread_mutex_unlock(&poolWheelLock);
+    http_server_connection_destroy(conn);
 }
 
 int main(int argc, char *argv[]) {
     signal(SIGINT, intHandler);
+    signal(SIGPIPE, SIG_IGN);
 
-    thread_count = 0;
-    int thread_size = 5;
-    threads = malloc(sizeof *threads * thread_size);
-
-    http_server_parse_arguments(argc, argv, &config);
+    if (http_server_parse_arguments(argc, argv, &config) == 1) {
+        return EXIT_FAILURE;
+    }
 
     if ((mySocket = http_server_create(config)) == -1) {
         log_error("Could not create socket.");
         return 0;
     }
 
+    if (http_server_load_error_pages(config.relative_path) == 1) {
+        log_error("Could not load the error pages.");
+        return EXIT_FAILURE;
+    }
+    if (path_cache_init(config.relative_path, PATH_CACHE_DEFAULT_MAX_PATHS,
+                        config.stat_interval_ms) == 1) {
+        return EXIT_FAILURE;
+    }
+    file_cache_init(config.relative_path, (size_t)config.cache_mb * 1024 * 1024);
+    fd_cache_init(FD_CACHE_DEFAULT_MAX_FILES, config.stat_interval_ms);
+    if (config.access_log != NULL && access_log_open(config.access_log) == 1) {
+        return EXIT_FAILURE;
+    }
+
+    if (config.mode != MODE_POOL) {
+        int result = config.mode == MODE_URING ? uring_loop_run(mySocket, config, &running)
+                                               : event_loop_run(mySocket, config, &running);
+        access_log_close();
+        file_cache_shutdown();
+        fd_cache_shutdown();
+        path_cache_shutdown();
+        http_server_free_error_pages();
+        arena_pool_shutdown();
+        log_info("Responses done. Bye!");
+        return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    pthread_t reaper;
+    timer_wheel_init(&poolWheel, timer_wheel_now_ms());
+    if (pthread_create(&reaper, NULL, reap_connections, NULL) != 0) {
+        log_error("Could not start the timeout reaper.");
+        return EXIT_FAILURE;
+    }
+    ThreadPool *pool = thread_pool_create(config.num_threads, config.queue_depth, handle_client);
+    if (pool == NULL) {
+        log_error("Could not start the worker pool.");
+        return EXIT_FAILURE;
+    }
+    printf("server: %d workers, queue depth %d\n", pool->num_threads, config.queue_depth);
+
     while (running) { // main accept() loop
-        int *sock = malloc(sizeof(int));
-        if ((*sock = http_server_accept(mySocket)) == -1) {
+        int clientSocket;
+        if ((clientSocket = http_server_accept(mySocket)) == -1) {
             continue;
         }
 
-        pthread_t *aThread = add_thread(&threads, &thread_count, &thread_size);
-        pthread_create(aThread, NULL, handle_client, (void *)sock);
-        printf("thread_count main: %d\n", thread_count);
-    }
-
-    for (int i = 0; i < thread_count; i++) {
-        printf("trying to join\n");
-        pthread_join(threads[i], NULL);
-        printf("joined!\n");
+        if (thread_pool_submit(pool, clientSocket) == 1) {
+            close(clientSocket);
+        }
     }
 
-    threads = NULL;
-    free(threads);
+    // Workers still waiting on idle clients are only released by the reaper, so it stops last.
+    thread_pool_destroy(pool);
+    reaping = false;
+    pthread_join(reaper, NULL);
+    access_log_close();
+    file_cache_shutdown();
+    fd_cache_shutdown();
+    path_cache_shutdown();
+    http_server_free_error_pages();
+    arena_pool_shutdown();
     log_info("Responses done. Bye!");
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
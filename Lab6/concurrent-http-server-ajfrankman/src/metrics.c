@@ -0,0 +1,221 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+
+// The status codes the server sends, each counted on its own; anything else is "other".
+static const int statusCodes[] = {200, 206, 304, 400, 404, 405, 416, 500};
+#define NUM_STATUSES (sizeof(statusCodes) / sizeof(statusCodes[0]) + 1)
+
+// Everything one thread counts. Shards start on their own cache line and are a whole number of
+// lines long, so threads never write to a line another thread writes to. Updates are relaxed
+// atomic adds: the line stays in its thread's cache, and threads past METRICS_MAX_SHARDS can
+// share a shard without losing counts.
+typedef struct MetricsShard {
+    uint64_t counters[METRIC_COUNTERS];
+    uint64_t statuses[NUM_STATUSES];
+    uint64_t buckets[METRIC_PHASES][METRICS_BUCKETS];
+    uint64_t sums[METRIC_PHASES]; // In nanoseconds.
+} __attribute__((aligned(64))) MetricsShard;
+
+static MetricsShard shards[METRICS_MAX_SHARDS];
+static unsigned nextShard = 0;
+static __thread MetricsShard *localShard = NULL;
+
+static const struct {
+    const char *name;
+    const char *help;
+} counterInfo[METRIC_COUNTERS] = {
+    [METRIC_BYTES_SENT] = {"http_response_bytes_total", "Bytes of responses sent."},
+    [METRIC_CONNECTIONS_OPENED] = {"http_connections_opened_total", "Connections accepted."},
+    [METRIC_CONNECTIONS_CLOSED] = {"http_connections_closed_total", "Connections closed."},
+    [METRIC_ACCESS_LOG_DROPPED] = {"http_access_log_dropped_total",
+                                   "Access log entries dropped because the writer fell behind."},
+};
+
+static const struct {
+    const char *cache;
+    MetricsCounter hits;
+    MetricsCounter misses;
+} cacheInfo[] = {
+    {"path", METRIC_PATH_CACHE_HITS, METRIC_PATH_CACHE_MISSES},
+    {"fd", METRIC_FD_CACHE_HITS, METRIC_FD_CACHE_MISSES},
+    {"file", METRIC_FILE_CACHE_HITS, METRIC_FILE_CACHE_MISSES},
+};
+
+static const char *phaseNames[METRIC_PHASES] = {"receive", "process", "send"};
+
+static MetricsShard *shard(void) {
+    if (localShard == NULL) {
+        unsigned index = __atomic_fetch_add(&nextShard, 1, __ATOMIC_RELAXED);
+        localShard = &shards[index % METRICS_MAX_SHARDS];
+    }
+    return localShard;
+}
+
+static void add(uint64_t *counter, uint64_t amount) {
+    __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+static uint64_t load(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/*
+Description:
+    Find the latency bucket of a duration.
+Arguments:
+    uint64_t microseconds: The duration.
+Return value:
+    Returns the index of the bucket.
+*/
+static int bucket_index(uint64_t microseconds) {
+    if (microseconds < SUB_BUCKETS) {
+        return (int)microseconds;
+    }
+    int exponent = 63 - __builtin_clzll(microseconds);
+    if (exponent >= METRICS_MAX_EXPONENT) {
+        return METRICS_BUCKETS - 1;
+    }
+    int group = exponent - METRICS_SUB_BUCKET_BITS + 1;
+    int sub = (int)(microseconds >> (exponent - METRICS_SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return group * SUB_BUCKETS + sub;
+}
+
+/*
+Description:
+    Find where a latency bucket ends. The last bucket has no end.
+Arguments:
+    int index: The index of the bucket, below METRICS_BUCKETS - 1.
+Return value:
+    Returns the first duration in microseconds that is past the bucket.
+*/
+static uint64_t bucket_end(int index) {
+    if (index < SUB_BUCKETS) {
+        return index + 1;
+    }
+    int group = index / SUB_BUCKETS;
+    int sub = index % SUB_BUCKETS;
+    return (uint64_t)(SUB_BUCKETS + sub + 1) << (group - 1);
+}
+
+uint64_t metrics_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+void metrics_add(MetricsCounter counter, uint64_t amount) {
+    add(&shard()->counters[counter], amount);
+}
+
+void metrics_count_status(int status) {
+    size_t i = 0;
+    while (i < NUM_STATUSES - 1 && statusCodes[i] != status) {
+        i++;
+    }
+    add(&shard()->statuses[i], 1);
+}
+
+void metrics_observe(MetricsPhase phase, uint64_t nanoseconds) {
+    MetricsShard *local = shard();
+    add(&local->buckets[phase][bucket_index(nanoseconds / 1000)], 1);
+    add(&local->sums[phase], nanoseconds);
+}
+
+char *metrics_render(Arena *arena, size_t *length) {
+    // Every line is well under 128 bytes: the headers, one line per counter, status and cache,
+    // and the buckets, sum and count of each phase.
+    size_t capacity =
+        128 * (32 + METRIC_COUNTERS + NUM_STATUSES + METRIC_PHASES * (METRICS_BUCKETS + 2));
+    char *text = arena_alloc(arena, capacity);
+    size_t used = 0;
+    MetricsShard sum;
+
+    if (text == NULL) {
+        return NULL;
+    }
+    memset(&sum, 0, sizeof sum);
+    unsigned numShards = __atomic_load_n(&nextShard, __ATOMIC_RELAXED);
+    if (numShards > METRICS_MAX_SHARDS) {
+        numShards = METRICS_MAX_SHARDS;
+    }
+    for (unsigned i = 0; i < numShards; i++) {
+        for (int c = 0; c < METRIC_COUNTERS; c++) {
+            sum.counters[c] += load(&shards[i].counters[c]);
+        }
+        for (size_t s = 0; s < NUM_STATUSES; s++) {
+            sum.statuses[s] += load(&shards[i].statuses[s]);
+        }
+        for (int p = 0; p < METRIC_PHASES; p++) {
+            for (int b = 0; b < METRICS_BUCKETS; b++) {
+                sum.buckets[p][b] += load(&shards[i].buckets[p][b]);
+            }
+            sum.sums[p] += load(&shards[i].sums[p]);
+        }
+    }
+
+#define EMIT(...) used += snprintf(text + used, capacity - used, __VA_ARGS__)
+    EMIT("# HELP http_responses_total Responses sent in full, by status code.\n"
+         "# TYPE http_responses_total counter\n");
+    for (size_t s = 0; s < NUM_STATUSES - 1; s++) {
+        EMIT("http_responses_total{status=\"%d\"} %llu\n", statusCodes[s],
+             (unsigned long long)sum.statuses[s]);
+    }
+    EMIT("http_responses_total{status=\"other\"} %llu\n",
+         (unsigned long long)sum.statuses[NUM_STATUSES - 1]);
+
+    for (int c = 0; c < METRIC_COUNTERS; c++) {
+        if (counterInfo[c].name != NULL) {
+            EMIT("# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counterInfo[c].name,
+                 counterInfo[c].help, counterInfo[c].name, counterInfo[c].name,
+                 (unsigned long long)sum.counters[c]);
+        }
+    }
+    // Opened and closed are counted by whichever thread did it, so only their difference means
+    // anything; clamp the moment a close is counted before its open is.
+    uint64_t opened = sum.counters[METRIC_CONNECTIONS_OPENED];
+    uint64_t closed = sum.counters[METRIC_CONNECTIONS_CLOSED];
+    EMIT("# HELP http_connections_active Connections currently open.\n"
+         "# TYPE http_connections_active gauge\n"
+         "http_connections_active %llu\n",
+         (unsigned long long)(opened > closed ? opened - closed : 0));
+
+    EMIT("# HELP http_cache_hits_total Lookups answered by a cache.\n"
+         "# TYPE http_cache_hits_total counter\n");
+    for (size_t i = 0; i < sizeof(cacheInfo) / sizeof(cacheInfo[0]); i++) {
+        EMIT("http_cache_hits_total{cache=\"%s\"} %llu\n", cacheInfo[i].cache,
+             (unsigned long long)sum.counters[cacheInfo[i].hits]);
+    }
+    EMIT("# HELP http_cache_misses_total Lookups a cache had to go to the disk for.\n"
+         "# TYPE http_cache_misses_total counter\n");
+    for (size_t i = 0; i < sizeof(cacheInfo) / sizeof(cacheInfo[0]); i++) {
+        EMIT("http_cache_misses_total{cache=\"%s\"} %llu\n", cacheInfo[i].cache,
+             (unsigned long long)sum.counters[cacheInfo[i].misses]);
+    }
+
+    EMIT("# HELP http_request_phase_seconds Time spent in each phase of a request.\n"
+         "# TYPE http_request_phase_seconds histogram\n");
+    for (int p = 0; p < METRIC_PHASES; p++) {
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRICS_BUCKETS - 1; b++) {
+            cumulative += sum.buckets[p][b];
+            EMIT("http_request_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n",
+                 phaseNames[p], bucket_end(b) / 1e6, (unsigned long long)cumulative);
+        }
+        cumulative += sum.buckets[p][METRICS_BUCKETS - 1];
+        EMIT("http_request_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n", phaseNames[p],
+             (unsigned long long)cumulative);
+        EMIT("http_request_phase_seconds_sum{phase=\"%s\"} %.9f\n", phaseNames[p],
+             sum.sums[p] / 1e9);
+        EMIT("http_request_phase_seconds_count{phase=\"%s\"} %llu\n", phaseNames[p],
+             (unsigned long long)cumulative);
+    }
+#undef EMIT
+
+    *length = used < capacity ? used : capacity - 1;
+    return text;
+}
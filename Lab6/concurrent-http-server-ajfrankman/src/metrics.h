@@ -0,0 +1,95 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include "arena.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Threads get a shard of their own up to this many; any more share them round robin.
+#define METRICS_MAX_SHARDS 128
+// Latency buckets are log-linear over microseconds: 4 linear buckets per power of two, from 1us
+// up to 2^METRICS_MAX_EXPONENT us (about 67s), plus one for anything longer.
+#define METRICS_SUB_BUCKET_BITS 2
+#define METRICS_MAX_EXPONENT 26
+#define METRICS_BUCKETS                                                                           \
+    (((METRICS_MAX_EXPONENT - METRICS_SUB_BUCKET_BITS + 1) << METRICS_SUB_BUCKET_BITS) + 1)
+
+typedef enum MetricsCounter {
+    METRIC_BYTES_SENT,
+    METRIC_CONNECTIONS_OPENED,
+    METRIC_CONNECTIONS_CLOSED,
+    METRIC_PATH_CACHE_HITS,
+    METRIC_PATH_CACHE_MISSES,
+    METRIC_FD_CACHE_HITS,
+    METRIC_FD_CACHE_MISSES,
+    METRIC_FILE_CACHE_HITS,
+    METRIC_FILE_CACHE_MISSES,
+    METRIC_ACCESS_LOG_DROPPED,
+    METRIC_COUNTERS,
+} MetricsCounter;
+
+// The phases of a request: from its first byte to its whole header block, from there to the
+// response being ready to send, and from there to its last byte being sent.
+typedef enum MetricsPhase {
+    METRIC_RECEIVE,
+    METRIC_PROCESS,
+    METRIC_SEND,
+    METRIC_PHASES,
+} MetricsPhase;
+
+/*
+Description:
+    Read the clock phases are timed with.
+Arguments:
+    None
+Return value:
+    Returns monotonic nanoseconds.
+*/
+uint64_t metrics_now_ns(void);
+
+/*
+Description:
+    Add to a counter in the calling thread's shard.
+Arguments:
+    MetricsCounter counter: The counter.
+    uint64_t amount: How much to add.
+Return value:
+    None
+*/
+void metrics_add(MetricsCounter counter, uint64_t amount);
+
+/*
+Description:
+    Count a response that was sent in full.
+Arguments:
+    int status: Its status code.
+Return value:
+    None
+*/
+void metrics_count_status(int status);
+
+/*
+Description:
+    Record how long one phase of a request took.
+Arguments:
+    MetricsPhase phase: The phase.
+    uint64_t nanoseconds: How long it took.
+Return value:
+    None
+*/
+void metrics_observe(MetricsPhase phase, uint64_t nanoseconds);
+
+/*
+Description:
+    Add up every shard into the Prometheus text exposition format. Shards are read without
+    stopping their threads, so the totals are not a snapshot of a single instant.
+Arguments:
+    Arena *arena: Where to allocate the text.
+    size_t *length: Set to the length of the text.
+Return value:
+    Returns the text, or NULL if it could not be allocated.
+*/
+char *metrics_render(Arena *arena, size_t *length);
+
+#endif
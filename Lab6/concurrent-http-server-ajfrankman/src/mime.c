@@ -0,0 +1,33 @@
+#include "mime.h"
+// Generated from tools/mime.types into the object directory by the Makefile.
+#include "mime_table.h"
+
+#include <string.h>
+
+static const MimeType unknownType = {"", "application/octet-stream", false};
+
+const MimeType *mime_lookup(const char *path) {
+    const char *dot = strrchr(path, '.');
+    char extension[MIME_TABLE_MAX_EXTENSION + 1];
+
+    if (dot == NULL || strchr(dot, '/') != NULL) {
+        return &unknownType;
+    }
+    size_t length = strlen(dot + 1);
+    if (length == 0 || length > MIME_TABLE_MAX_EXTENSION) {
+        return &unknownType;
+    }
+    for (size_t i = 0; i < length; i++) {
+        char c = dot[1 + i];
+        extension[i] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+    extension[length] = '\0';
+
+    // The one slot the extension can be in; the compare tells a hit from another extension.
+    const MimeType *entry =
+        &mimeTable[mime_hash(extension, length, MIME_TABLE_SEED) % MIME_TABLE_SIZE];
+    if (entry->extension == NULL || strcmp(entry->extension, extension) != 0) {
+        return &unknownType;
+    }
+    return entry;
+}
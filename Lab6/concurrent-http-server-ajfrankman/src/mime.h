@@ -0,0 +1,47 @@
+#ifndef MIME_H_
+#define MIME_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// What a file extension says about the files that have it. The table of known extensions is
+// generated from tools/mime.types at build time.
+typedef struct MimeType {
+    const char *extension; // Lower case, without the dot.
+    const char *type;      // The Content-Type value.
+    bool compressible;     // Worth compressing on the fly; images and archives are already.
+} MimeType;
+
+/*
+Description:
+    Hash an extension into the generated table. tools/mimegen.c searches for a seed under which
+    every extension in the table lands in its own slot, so a lookup probes exactly one slot.
+Arguments:
+    const char *extension: The lower case extension.
+    size_t length: The length of extension.
+    uint32_t seed: The seed the table was generated with.
+Return value:
+    Returns the hash; the slot is the hash modulo the table size.
+*/
+static inline uint32_t mime_hash(const char *extension, size_t length, uint32_t seed) {
+    // FNV-1a, with the seed as the offset basis.
+    uint32_t hash = 2166136261u ^ seed;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)extension[i];
+        hash *= 16777619u;
+    }
+    return hash ^ (hash >> 15);
+}
+
+/*
+Description:
+    Look up the type of a file by the extension of its path, ignoring case.
+Arguments:
+    const char *path: The path of the file.
+Return value:
+    Returns the type, never NULL. Unknown extensions are application/octet-stream.
+*/
+const MimeType *mime_lookup(const char *path);
+
+#endif
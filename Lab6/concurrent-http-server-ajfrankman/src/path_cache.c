@@ -0,0 +1,346 @@
+#define _GNU_SOURCE
+
+#include "path_cache.h"
+#include "log.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct Stripe {
+    pthread_mutex_t lock;
+    PathEntry *lru_head; // Most recently used
+    PathEntry *lru_tail;
+    int num_paths;
+} Stripe;
+
+static struct {
+    PathEntry *buckets[PATH_CACHE_BUCKETS];
+    Stripe stripes[PATH_CACHE_STRIPES];
+    char *root; // Canonical, without a trailing slash.
+    size_t root_length;
+    int max_paths; // Per stripe.
+    int revalidate_ms;
+} P;
+
+static unsigned long hash_path(const char *path, size_t length) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+    return (unsigned long)(hash % PATH_CACHE_BUCKETS);
+}
+
+static Stripe *stripe_of(unsigned long bucket) {
+    return &P.stripes[bucket % PATH_CACHE_STRIPES];
+}
+
+static void free_entry(PathEntry *entry) {
+    free(entry->key);
+    free(entry->resolved);
+    free(entry);
+}
+
+static void lru_unlink(Stripe *stripe, PathEntry *entry) {
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        stripe->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        stripe->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push_front(Stripe *stripe, PathEntry *entry) {
+    entry->lru_next = stripe->lru_head;
+    if (stripe->lru_head != NULL) {
+        stripe->lru_head->lru_prev = entry;
+    }
+    stripe->lru_head = entry;
+    if (stripe->lru_tail == NULL) {
+        stripe->lru_tail = entry;
+    }
+}
+
+/*
+Description:
+    Take an entry out of the table and free it. Must be called with its stripe's lock held.
+Arguments:
+    PathEntry *entry: The entry to remove.
+Return value:
+    None
+*/
+static void remove_entry(PathEntry *entry) {
+    unsigned long bucket = hash_path(entry->key, entry->key_length);
+    Stripe *stripe = stripe_of(bucket);
+    PathEntry **link = &P.buckets[bucket];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+
+    lru_unlink(stripe, entry);
+    stripe->num_paths--;
+    free_entry(entry);
+}
+
+/*
+Description:
+    Find the entry for a request path. Must be called with its stripe's lock held.
+Arguments:
+    const char *key: The request path without its query or fragment.
+    size_t length: The length of key.
+    unsigned long bucket: The hash bucket of key.
+Return value:
+    Returns the entry, or NULL if there is none.
+*/
+static PathEntry *find_entry(const char *key, size_t length, unsigned long bucket) {
+    for (PathEntry *entry = P.buckets[bucket]; entry != NULL; entry = entry->next) {
+        if (entry->key_length == length && memcmp(entry->key, key, length) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/*
+Description:
+    Decode the percent escapes of a request path and remove its dot segments as RFC 3986 section
+    5.2.4 does, so ".." never climbs above "/". Empty segments are dropped too.
+Arguments:
+    const char *path: The request path without its query or fragment.
+    size_t length: The length of path.
+Return value:
+    Returns the canonical path, which starts with "/" and must be freed, or NULL if the path is
+    not absolute, has a malformed escape or contains a NUL byte.
+*/
+static char *canonicalize(const char *path, size_t length) {
+    if (length == 0 || path[0] != '/') {
+        return NULL;
+    }
+
+    char *decoded = malloc(length + 1);
+    char *out = malloc(length + 2);
+    if (decoded == NULL || out == NULL) {
+        free(decoded);
+        free(out);
+        return NULL;
+    }
+    size_t decodedLength = 0;
+    for (size_t i = 0; i < length; i++) {
+        int c = (unsigned char)path[i];
+        if (c == '%') {
+            if (i + 2 >= length || hex_value(path[i + 1]) == -1 ||
+                hex_value(path[i + 2]) == -1) {
+                free(decoded);
+                free(out);
+                return NULL;
+            }
+            c = hex_value(path[i + 1]) * 16 + hex_value(path[i + 2]);
+            i += 2;
+        }
+        if (c == '\0') {
+            free(decoded);
+            free(out);
+            return NULL;
+        }
+        decoded[decodedLength++] = c;
+    }
+    decoded[decodedLength] = '\0';
+
+    // Copy segment by segment, backing up over the last one copied for each "..".
+    size_t outLength = 0;
+    const char *segment = decoded;
+    while (*segment != '\0') {
+        segment++; // Past the slash.
+        const char *end = strchrnul(segment, '/');
+        size_t segmentLength = end - segment;
+        bool dot = segmentLength == 1 && segment[0] == '.';
+        bool dotDot = segmentLength == 2 && segment[0] == '.' && segment[1] == '.';
+
+        if (dotDot) {
+            while (outLength > 0 && out[--outLength] != '/') {
+            }
+        } else if (segmentLength > 0 && !dot) {
+            out[outLength++] = '/';
+            memcpy(out + outLength, segment, segmentLength);
+            outLength += segmentLength;
+        }
+        // A path that names a directory keeps saying so.
+        if (*end == '\0' && (segmentLength == 0 || dot || dotDot)) {
+            out[outLength++] = '/';
+        }
+        segment = end;
+    }
+    if (outLength == 0) {
+        out[outLength++] = '/';
+    }
+    out[outLength] = '\0';
+    free(decoded);
+    return out;
+}
+
+/*
+Description:
+    Resolve a request path on disk.
+Arguments:
+    const char *key: The request path without its query or fragment.
+    size_t length: The length of key.
+Return value:
+    Returns the canonical path of the file, which must be freed, or NULL if there is none under
+    the root.
+*/
+static char *resolve(const char *key, size_t length) {
+    char *canonical = canonicalize(key, length);
+    if (canonical == NULL) {
+        return NULL;
+    }
+    char joined[P.root_length + strlen(canonical) + 1];
+    sprintf(joined, "%s%s", P.root, canonical);
+    free(canonical);
+
+    char *resolved = realpath(joined, NULL);
+    if (resolved == NULL) {
+        return NULL;
+    }
+    // A symbolic link may still point out of the root.
+    if (strncmp(resolved, P.root, P.root_length) != 0 ||
+        (resolved[P.root_length] != '/' && resolved[P.root_length] != '\0')) {
+        log_error("path cache: %.*s leaves the root", (int)length, key);
+        free(resolved);
+        return NULL;
+    }
+    return resolved;
+}
+
+int path_cache_init(const char *root, int max_paths, int revalidate_ms) {
+    if ((P.root = realpath(root, NULL)) == NULL) {
+        log_error("Could not resolve %s.", root);
+        return 1;
+    }
+    P.root_length = strlen(P.root);
+    if (P.root_length == 1) {
+        // The root of the file system; a slash is added by every path joined to it.
+        P.root[0] = '\0';
+        P.root_length = 0;
+    }
+    P.max_paths = (max_paths + PATH_CACHE_STRIPES - 1) / PATH_CACHE_STRIPES;
+    P.revalidate_ms = revalidate_ms;
+    for (int i = 0; i < PATH_CACHE_STRIPES; i++) {
+        pthread_mutex_init(&P.stripes[i].lock, NULL);
+    }
+    return 0;
+}
+
+char *path_cache_resolve(const char *path, size_t length, Arena *arena) {
+    // The query and fragment are not part of the file name.
+    for (size_t i = 0; i < length; i++) {
+        if (path[i] == '?' || path[i] == '#') {
+            length = i;
+            break;
+        }
+    }
+    // No file name has a raw control byte in it, and keys must not hide bytes behind a NUL.
+    for (size_t i = 0; i < length; i++) {
+        if ((unsigned char)path[i] < 0x20 || path[i] == 0x7f) {
+            return NULL;
+        }
+    }
+    unsigned long bucket = hash_path(path, length);
+    Stripe *stripe = stripe_of(bucket);
+    uint64_t now = timer_wheel_now_ms();
+    char *result = NULL;
+
+    pthread_mutex_lock(&stripe->lock);
+    PathEntry *entry = find_entry(path, length, bucket);
+    if (entry != NULL && now - entry->checked_ms < (uint64_t)P.revalidate_ms) {
+        metrics_add(METRIC_PATH_CACHE_HITS, 1);
+        if (entry->resolved != NULL) {
+            result = arena_strdup(arena, entry->resolved);
+        }
+        lru_unlink(stripe, entry);
+        lru_push_front(stripe, entry);
+        pthread_mutex_unlock(&stripe->lock);
+        return result;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+
+    // Miss or out of date: resolve without holding the lock.
+    metrics_add(METRIC_PATH_CACHE_MISSES, 1);
+    char *resolved = resolve(path, length);
+    if (resolved != NULL) {
+        result = arena_strdup(arena, resolved);
+    }
+    if (P.max_paths == 0) {
+        free(resolved);
+        return result;
+    }
+
+    pthread_mutex_lock(&stripe->lock);
+    if ((entry = find_entry(path, length, bucket)) != NULL) {
+        // Either out of date or filled in by another thread meanwhile; this result is as new.
+        free(entry->resolved);
+        entry->resolved = resolved;
+        entry->checked_ms = now;
+        pthread_mutex_unlock(&stripe->lock);
+        return result;
+    }
+    if ((entry = calloc(1, sizeof(PathEntry))) == NULL ||
+        (entry->key = malloc(length + 1)) == NULL) {
+        pthread_mutex_unlock(&stripe->lock);
+        free(entry);
+        free(resolved);
+        return result;
+    }
+    memcpy(entry->key, path, length);
+    entry->key[length] = '\0';
+    entry->key_length = length;
+    entry->resolved = resolved;
+    entry->checked_ms = now;
+    while (stripe->num_paths >= P.max_paths && stripe->lru_tail != NULL) {
+        remove_entry(stripe->lru_tail);
+    }
+    entry->next = P.buckets[bucket];
+    P.buckets[bucket] = entry;
+    lru_push_front(stripe, entry);
+    stripe->num_paths++;
+    pthread_mutex_unlock(&stripe->lock);
+
+    return result;
+}
+
+void path_cache_shutdown(void) {
+    for (int i = 0; i < PATH_CACHE_STRIPES; i++) {
+        pthread_mutex_lock(&P.stripes[i].lock);
+        while (P.stripes[i].lru_head != NULL) {
+            remove_entry(P.stripes[i].lru_head);
+        }
+        pthread_mutex_unlock(&P.stripes[i].lock);
+    }
+    free(P.root);
+    P.root = NULL;
+}
@@ -0,0 +1,66 @@
+#ifndef PATH_CACHE_H_
+#define PATH_CACHE_H_
+
+#include "arena.h"
+
+#include <stdint.h>
+
+#define PATH_CACHE_BUCKETS 1024
+// The table is split into stripes with a lock each, so threads resolving different paths rarely
+// wait on each other. Buckets are assigned to stripes round robin.
+#define PATH_CACHE_STRIPES 16
+#define PATH_CACHE_DEFAULT_MAX_PATHS 4096
+
+// What a request path resolved to. A NULL resolved path is a negative entry: the request path
+// names nothing under the root, or escapes it through a symbolic link.
+typedef struct PathEntry {
+    char *key;           // The request path without its query or fragment; the hash key.
+    size_t key_length;   // The length key was hashed with.
+    char *resolved;      // The canonical path of the file, or NULL.
+    uint64_t checked_ms; // When the path was last resolved on disk.
+
+    struct PathEntry *next; // Hash chain
+    struct PathEntry *lru_prev;
+    struct PathEntry *lru_next;
+} PathEntry;
+
+/*
+Description:
+    Set up the shared path cache.
+Arguments:
+    const char *root: The folder files are served from. No path resolves outside of it.
+    int max_paths: The most request paths to remember. 0 resolves every request from scratch.
+    int revalidate_ms: How long a resolution is trusted before it is done again, which notices
+        files that appear, disappear or are replaced by links. 0 resolves on every request.
+Return value:
+    Returns a 1 on failure, such as the root not existing, 0 on success.
+*/
+int path_cache_init(const char *root, int max_paths, int revalidate_ms);
+
+/*
+Description:
+    Map the path of a request to the file it names. The query and fragment are dropped, percent
+    escapes are decoded, "." and ".." segments are removed without climbing above the root, and
+    symbolic links are resolved; a path that ends up outside the root does not resolve. A path
+    with raw control bytes, NUL included, is rejected before it is hashed or cached.
+Arguments:
+    const char *path: The path from the request line. Need not be NUL-terminated.
+    size_t length: The length of path.
+    Arena *arena: Where to copy the result.
+Return value:
+    Returns the canonical path of the file, allocated from arena, or NULL if the request path is
+    malformed, names nothing or leaves the root. The file is not necessarily a regular file.
+*/
+char *path_cache_resolve(const char *path, size_t length, Arena *arena);
+
+/*
+Description:
+    Free every entry.
+Arguments:
+    None
+Return value:
+    None
+*/
+void path_cache_shutdown(void);
+
+#endif
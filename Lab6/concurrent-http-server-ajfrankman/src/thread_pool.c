@@ -0,0 +1,128 @@
+#include "thread_pool.h"
+#include "log.h"
+
+#include <stdlib.h>
+
+static void *thread_pool_worker(void *arg) {
+    ThreadPool *pool = (ThreadPool *)arg;
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0 && !pool->shutdown) {
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        }
+        if (pool->count == 0) {
+            // Shut down and nothing left to do.
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+
+        int socket = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->capacity;
+        pool->count--;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->job(socket);
+    }
+}
+
+/*
+Description:
+    Start num_threads workers that run job on each socket submitted to the pool.
+Arguments:
+    int num_threads: How many worker threads to start.
+    int queue_depth: How many accepted sockets may wait for a worker.
+    ThreadPoolJob job: The function each worker calls with a socket.
+Return value:
+    Returns the new pool or NULL if an error occurs.
+*/
+ThreadPool *thread_pool_create(int num_threads, int queue_depth, ThreadPoolJob job) {
+    ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->threads = malloc(sizeof(pthread_t) * num_threads);
+    pool->queue = malloc(sizeof(int) * queue_depth);
+    if (pool->threads == NULL || pool->queue == NULL) {
+        free(pool->threads);
+        free(pool->queue);
+        free(pool);
+        return NULL;
+    }
+    pool->capacity = queue_depth;
+    pool->job = job;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, thread_pool_worker, pool) != 0) {
+            log_error("Could not start worker %d.", i);
+            break;
+        }
+        pool->num_threads++;
+    }
+
+    if (pool->num_threads == 0) {
+        thread_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/*
+Description:
+    Queue a client socket for the next free worker. *This blocks while the queue is full*, which
+    pushes back on the accept loop instead of growing memory during a connection storm.
+Arguments:
+    ThreadPool *pool: The pool to submit to.
+    int socket: The client socket. The pool owns it once this returns 0.
+Return value:
+    Returns a 1 if the pool is shutting down, 0 on success.
+*/
+int thread_pool_submit(ThreadPool *pool, int socket) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count == pool->capacity && !pool->shutdown) {
+        pthread_cond_wait(&pool->not_full, &pool->lock);
+    }
+    if (pool->shutdown) {
+        pthread_mutex_unlock(&pool->lock);
+        return 1;
+    }
+
+    pool->queue[(pool->head + pool->count) % pool->capacity] = socket;
+    pool->count++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/*
+Description:
+    Stop taking new sockets, let the workers finish everything already queued, join them and
+    free the pool.
+Arguments:
+    ThreadPool *pool: The pool to destroy.
+Return value:
+    None
+*/
+void thread_pool_destroy(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_cond_broadcast(&pool->not_full);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_cond_destroy(&pool->not_full);
+    free(pool->threads);
+    free(pool->queue);
+    free(pool);
+}
@@ -0,0 +1,64 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+
+// The work each pool thread runs for one accepted client socket. It owns the socket.
+typedef void (*ThreadPoolJob)(int socket);
+
+// A fixed set of worker threads fed by a bounded queue of accepted sockets. Any number of
+// threads may submit and any number of workers take from it.
+typedef struct ThreadPool {
+    pthread_t *threads;
+    int num_threads;
+
+    int *queue; // Ring buffer of client sockets.
+    int capacity;
+    int head;
+    int count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    bool shutdown;
+
+    ThreadPoolJob job;
+} ThreadPool;
+
+/*
+Description:
+    Start num_threads workers that run job on each socket submitted to the pool.
+Arguments:
+    int num_threads: How many worker threads to start.
+    int queue_depth: How many accepted sockets may wait for a worker.
+    ThreadPoolJob job: The function each worker calls with a socket.
+Return value:
+    Returns the new pool or NULL if an error occurs.
+*/
+ThreadPool *thread_pool_create(int num_threads, int queue_depth, ThreadPoolJob job);
+
+/*
+Description:
+    Queue a client socket for the next free worker. *This blocks while the queue is full*, which
+    pushes back on the accept loop instead of growing memory during a connection storm.
+Arguments:
+    ThreadPool *pool: The pool to submit to.
+    int socket: The client socket. The pool owns it once this returns 0.
+Return value:
+    Returns a 1 if the pool is shutting down, 0 on success.
+*/
+int thread_pool_submit(ThreadPool *pool, int socket);
+
+/*
+Description:
+    Stop taking new sockets, let the workers finish everything already queued, join them and
+    free the pool.
+Arguments:
+    ThreadPool *pool: The pool to destroy.
+Return value:
+    None
+*/
+void thread_pool_destroy(ThreadPool *pool);
+
+#endif
@@ -0,0 +1,117 @@
+#include "timer_wheel.h"
+
+#include <time.h>
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+// The number of ticks one slot of a level covers, and the span of a whole level.
+#define LEVEL_TICKS(level) ((uint64_t)1 << (TIMER_WHEEL_SLOT_BITS * (level)))
+
+uint64_t timer_wheel_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now_ms) {
+    wheel->now = now_ms / TIMER_WHEEL_TICK_MS;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            Timer *head = &wheel->slots[level][slot];
+            head->prev = head;
+            head->next = head;
+        }
+    }
+}
+
+/*
+Description:
+    Link an unarmed timer into the slot its expiry falls in: the lowest level whose span still
+    reaches it.
+Arguments:
+    TimerWheel *wheel: The wheel to put the timer on.
+    Timer *timer: The timer, with expires already set.
+Return value:
+    None
+*/
+static void insert(TimerWheel *wheel, Timer *timer) {
+    uint64_t delta = timer->expires - wheel->now;
+    int level = 0;
+
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= LEVEL_TICKS(level + 1)) {
+        level++;
+    }
+    if (delta >= LEVEL_TICKS(TIMER_WHEEL_LEVELS)) {
+        // Out of range; park it as far out as the wheel goes.
+        timer->expires = wheel->now + LEVEL_TICKS(TIMER_WHEEL_LEVELS) - 1;
+    }
+
+    Timer *head =
+        &wheel->slots[level][(timer->expires >> (TIMER_WHEEL_SLOT_BITS * level)) & SLOT_MASK];
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+    timer->armed = true;
+}
+
+void timer_wheel_schedule(TimerWheel *wheel, Timer *timer, uint64_t when_ms) {
+    uint64_t expires = when_ms / TIMER_WHEEL_TICK_MS;
+
+    timer_wheel_cancel(timer);
+    timer->expires = expires > wheel->now ? expires : wheel->now + 1;
+    insert(wheel, timer);
+}
+
+void timer_wheel_cancel(Timer *timer) {
+    if (!timer->armed) {
+        return;
+    }
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->armed = false;
+}
+
+/*
+Description:
+    Spread the timers in one slot of a higher level back over the levels below it.
+Arguments:
+    TimerWheel *wheel: The wheel.
+    int level: The level of the slot, at least 1.
+    int slot: The slot to empty.
+Return value:
+    None
+*/
+static void cascade(TimerWheel *wheel, int level, int slot) {
+    Timer *head = &wheel->slots[level][slot];
+
+    while (head->next != head) {
+        Timer *timer = head->next;
+        timer_wheel_cancel(timer);
+        insert(wheel, timer);
+    }
+}
+
+void timer_wheel_advance(TimerWheel *wheel, uint64_t now_ms, TimerCallback callback, void *arg) {
+    uint64_t target = now_ms / TIMER_WHEEL_TICK_MS;
+
+    while (wheel->now < target) {
+        wheel->now++;
+
+        // When a level wraps, the next slot of the level above comes due.
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if ((wheel->now & (LEVEL_TICKS(level) - 1)) != 0) {
+                break;
+            }
+            cascade(wheel, level, (wheel->now >> (TIMER_WHEEL_SLOT_BITS * level)) & SLOT_MASK);
+        }
+
+        Timer *head = &wheel->slots[0][wheel->now & SLOT_MASK];
+        while (head->next != head) {
+            Timer *timer = head->next;
+            timer_wheel_cancel(timer);
+            callback(timer, arg);
+        }
+    }
+}
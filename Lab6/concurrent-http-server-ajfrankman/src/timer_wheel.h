@@ -0,0 +1,93 @@
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_TICK_MS 100
+#define TIMER_WHEEL_SLOT_BITS 8
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+// Four levels of 256 slots reach 256^4 ticks ahead, far beyond any connection deadline.
+#define TIMER_WHEEL_LEVELS 4
+
+// A deadline, embedded in whatever it belongs to. Armed timers sit in a doubly linked slot list,
+// so cancelling one is O(1).
+typedef struct Timer {
+    uint64_t expires; // In ticks.
+    bool armed;
+    void *data;
+    struct Timer *prev;
+    struct Timer *next;
+} Timer;
+
+typedef void (*TimerCallback)(Timer *timer, void *arg);
+
+// A hierarchical timing wheel. Level 0 has one slot per tick; each slot of level n covers a
+// whole turn of level n - 1 and is spread back down over it as the wheel reaches it. Insert and
+// cancel are O(1) and advancing costs O(1) per tick plus the timers that expire or cascade. A
+// wheel is not thread safe.
+typedef struct TimerWheel {
+    uint64_t now; // In ticks.
+    Timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // List heads.
+} TimerWheel;
+
+/*
+Description:
+    Get the current time of the monotonic clock the wheels run on.
+Arguments:
+    None
+Return value:
+    Returns the time in milliseconds.
+*/
+uint64_t timer_wheel_now_ms(void);
+
+/*
+Description:
+    Set up an empty wheel.
+Arguments:
+    TimerWheel *wheel: The wheel to set up.
+    uint64_t now_ms: The current time from timer_wheel_now_ms.
+Return value:
+    None
+*/
+void timer_wheel_init(TimerWheel *wheel, uint64_t now_ms);
+
+/*
+Description:
+    Arm a timer, or move it if it is already armed. Deadlines that have already passed fire on
+    the next tick.
+Arguments:
+    TimerWheel *wheel: The wheel to put the timer on.
+    Timer *timer: The timer to arm. Its data field is left alone.
+    uint64_t when_ms: When the timer expires, on the timer_wheel_now_ms clock.
+Return value:
+    None
+*/
+void timer_wheel_schedule(TimerWheel *wheel, Timer *timer, uint64_t when_ms);
+
+/*
+Description:
+    Disarm a timer. Does nothing if it is not armed.
+Arguments:
+    Timer *timer: The timer to cancel.
+Return value:
+    None
+*/
+void timer_wheel_cancel(Timer *timer);
+
+/*
+Description:
+    Move the wheel forward to now_ms and call callback for every timer that expired on the way.
+    Each timer is disarmed before its callback runs, so the callback may re-arm it or free the
+    object it is embedded in.
+Arguments:
+    TimerWheel *wheel: The wheel to advance.
+    uint64_t now_ms: The current time from timer_wheel_now_ms.
+    TimerCallback callback: Called with each expired timer.
+    void *arg: Passed through to callback.
+Return value:
+    None
+*/
+void timer_wheel_advance(TimerWheel *wheel, uint64_t now_ms, TimerCallback callback, void *arg);
+
+#endif
@@ -0,0 +1,599 @@
+#define _GNU_SOURCE
+
+#include "uring_loop.h"
+#include "log.h"
+
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// What a completion belongs to, kept in the low bits of its user_data. Connections come from
+// calloc, so their addresses leave those bits free.
+typedef enum UringOp {
+    OP_ACCEPT,
+    OP_TICK,
+    OP_CANCEL,
+    OP_RECV,
+    OP_SEND_HEAD, // The head, plus the first body part when it is in memory.
+    OP_SEND_BODY,
+    OP_READ_FILE,
+    OP_CLOSE,
+} UringOp;
+#define OP_MASK 7
+
+// The submission and completion rings shared with the kernel. liburing is not available, so the
+// rings are set up and driven with the raw system calls.
+typedef struct Ring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sqe_tail; // Entries up to here are filled in but not yet visible to the kernel.
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+} Ring;
+
+typedef struct UringLoop {
+    pthread_t thread;
+    Ring ring;
+    int listen_socket;
+    Config *config;
+    volatile bool *running;
+    Connection *connections; // Every open connection, so they can be shut down on exit.
+    TimerWheel wheel;        // The deadline of every open connection.
+    int in_flight;           // Operations queued whose completion has not been reaped.
+    bool stopping;
+    struct __kernel_timespec tick; // Read by the kernel while the tick timeout is pending.
+} UringLoop;
+
+static void ring_teardown(Ring *ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_map != NULL && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map != NULL) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    close(ring->fd);
+}
+
+static void *map_ring(Ring *ring, size_t size, off_t offset) {
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                     offset);
+    if (map == MAP_FAILED) {
+        log_error("mmap: %s", strerror(errno));
+        return NULL;
+    }
+    return map;
+}
+
+/*
+Description:
+    Create an io_uring instance and map its submission queue, completion queue and submission
+    entries into this process.
+Arguments:
+    Ring *ring: A zeroed ring to set up.
+    unsigned entries: The size of the submission queue.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+static int ring_setup(Ring *ring, unsigned entries) {
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof params);
+    if ((ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params)) == -1) {
+        log_error("io_uring_setup: %s", strerror(errno));
+        return 1;
+    }
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // Newer kernels put both rings in one mapping.
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size) {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+        ring->cq_map_size = ring->sq_map_size;
+    }
+
+    if ((ring->sq_map = map_ring(ring, ring->sq_map_size, IORING_OFF_SQ_RING)) == NULL) {
+        ring_teardown(ring);
+        return 1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else if ((ring->cq_map = map_ring(ring, ring->cq_map_size, IORING_OFF_CQ_RING)) == NULL) {
+        ring_teardown(ring);
+        return 1;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if ((ring->sqes = map_ring(ring, ring->sqes_size, IORING_OFF_SQES)) == NULL) {
+        ring_teardown(ring);
+        return 1;
+    }
+
+    char *sq = ring->sq_map;
+    char *cq = ring->cq_map;
+    ring->entries = params.sq_entries;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+/*
+Description:
+    Hand every queued submission to the kernel and, if asked, wait for at least one completion.
+Arguments:
+    Ring *ring: The ring to enter.
+    bool wait: Whether to block until a completion is available.
+Return value:
+    Returns -1 with errno set on failure, otherwise the number of submissions consumed.
+*/
+static int ring_enter(Ring *ring, bool wait) {
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    unsigned toSubmit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    return (int)syscall(__NR_io_uring_enter, ring->fd, toSubmit, wait ? 1 : 0,
+                        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static struct io_uring_sqe *ring_get_sqe(Ring *ring) {
+    if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->entries) {
+        // Full: submit what is queued so the kernel frees up the entries.
+        if (ring_enter(ring, false) == -1 ||
+            ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->entries) {
+            log_error("io_uring submission queue is full.");
+            return NULL;
+        }
+    }
+
+    unsigned index = ring->sqe_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    return sqe;
+}
+
+static struct io_uring_sqe *queue_op(UringLoop *loop, Connection *conn, UringOp op, int opcode,
+                                     int fd) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&loop->ring);
+    if (sqe == NULL) {
+        return NULL;
+    }
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | op;
+    loop->in_flight++;
+    return sqe;
+}
+
+static void queue_accept(UringLoop *loop) {
+    struct io_uring_sqe *sqe =
+        queue_op(loop, NULL, OP_ACCEPT, IORING_OP_ACCEPT, loop->listen_socket);
+    if (sqe != NULL) {
+        sqe->accept_flags = SOCK_CLOEXEC;
+    }
+}
+
+static void queue_tick(UringLoop *loop) {
+    struct io_uring_sqe *sqe = queue_op(loop, NULL, OP_TICK, IORING_OP_TIMEOUT, -1);
+    if (sqe != NULL) {
+        loop->tick.tv_sec = URING_LOOP_WAIT_MS / 1000;
+        loop->tick.tv_nsec = (URING_LOOP_WAIT_MS % 1000) * 1000000L;
+        sqe->addr = (uintptr_t)&loop->tick;
+        sqe->len = 1;
+    }
+}
+
+static void unlink_connection(UringLoop *loop, Connection *conn) {
+    timer_wheel_cancel(&conn->timer);
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        loop->connections = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+}
+
+/*
+Description:
+    Unlink a connection from its loop and queue the close of its socket. The connection is freed
+    when the close completes. Only called from a completion of the connection, so no other
+    operation of it is still in flight.
+Arguments:
+    UringLoop *loop: The loop that owns the connection.
+    Connection *conn: The connection to close.
+Return value:
+    None
+*/
+static void close_connection(UringLoop *loop, Connection *conn) {
+    unlink_connection(loop, conn);
+    if (queue_op(loop, conn, OP_CLOSE, IORING_OP_CLOSE, conn->socket) == NULL) {
+        http_server_connection_destroy(conn);
+        return;
+    }
+    conn->socket = -1;
+}
+
+/*
+Description:
+    Queue the next operation of a connection: a receive while its request is incomplete, then
+    the sends (and, for files not in the cache, the file reads) of the response. Requests that
+    are already buffered, such as pipelined ones, are answered without waiting for the socket.
+Arguments:
+    UringLoop *loop: The loop that owns the connection.
+    Connection *conn: The connection whose last operation completed.
+Return value:
+    None
+*/
+static void advance(UringLoop *loop, Connection *conn) {
+    Response *response = &conn->response;
+    struct io_uring_sqe *sqe = NULL;
+
+    while (true) {
+        if (conn->state == CONN_READING) {
+            int result = http_server_take_request(conn);
+            if (result == HTTP_SERVER_IO_AGAIN) {
+                if ((sqe = queue_op(loop, conn, OP_RECV, IORING_OP_RECV, conn->socket)) != NULL) {
+                    sqe->addr = (uintptr_t)(conn->recv_buf + conn->recv_len);
+                    sqe->len = conn->recv_cap - conn->recv_len - 1;
+                }
+                break;
+            } else if (result == HTTP_SERVER_IO_ERROR) {
+                close_connection(loop, conn);
+                return;
+            }
+            if (http_server_process_request(&conn->request, *loop->config, response) == 1) {
+                log_error("Could not build Response.");
+                close_connection(loop, conn);
+                return;
+            }
+            conn->requests_served++;
+            conn->keep_alive = http_server_set_keep_alive(&conn->request, response,
+                                                          conn->requests_served, *loop->config);
+            if (http_server_serialize_response_head(conn) == 1) {
+                close_connection(loop, conn);
+                return;
+            }
+            conn->state = CONN_WRITING;
+        }
+
+        const char *data = NULL;
+        off_t offset = 0;
+        size_t length = 0;
+        bool hasSpan = conn->chunk_pos == conn->chunk_len &&
+                       http_server_next_body_span(conn, &data, &offset, &length);
+        // Hold back whatever is not the end of the response until the bytes after it join it.
+        int more = hasSpan && conn->body_sent + length < response->content_length ? MSG_MORE : 0;
+
+        if (conn->chunk_pos < conn->chunk_len) {
+            if ((sqe = queue_op(loop, conn, OP_SEND_BODY, IORING_OP_SEND, conn->socket)) !=
+                NULL) {
+                sqe->addr = (uintptr_t)(conn->chunk + conn->chunk_pos);
+                sqe->len = conn->chunk_len - conn->chunk_pos;
+                sqe->msg_flags = MSG_NOSIGNAL;
+            }
+            break;
+        } else if (conn->send_pos < conn->send_len && data != NULL) {
+            conn->send_parts[0].iov_base = conn->send_buf + conn->send_pos;
+            conn->send_parts[0].iov_len = conn->send_len - conn->send_pos;
+            conn->send_parts[1].iov_base = (char *)data;
+            conn->send_parts[1].iov_len = length;
+            memset(&conn->send_message, 0, sizeof(struct msghdr));
+            conn->send_message.msg_iov = conn->send_parts;
+            conn->send_message.msg_iovlen = 2;
+            if ((sqe = queue_op(loop, conn, OP_SEND_HEAD, IORING_OP_SENDMSG, conn->socket)) !=
+                NULL) {
+                sqe->addr = (uintptr_t)&conn->send_message;
+                sqe->msg_flags = MSG_NOSIGNAL | more;
+            }
+            break;
+        } else if (conn->send_pos < conn->send_len) {
+            if ((sqe = queue_op(loop, conn, OP_SEND_HEAD, IORING_OP_SEND, conn->socket)) !=
+                NULL) {
+                sqe->addr = (uintptr_t)(conn->send_buf + conn->send_pos);
+                sqe->len = conn->send_len - conn->send_pos;
+                // Hold the head back until the first file bytes join it.
+                sqe->msg_flags = MSG_NOSIGNAL | (hasSpan ? MSG_MORE : 0);
+            }
+            break;
+        } else if (hasSpan && data != NULL) {
+            if ((sqe = queue_op(loop, conn, OP_SEND_BODY, IORING_OP_SEND, conn->socket)) !=
+                NULL) {
+                sqe->addr = (uintptr_t)data;
+                sqe->len = length;
+                sqe->msg_flags = MSG_NOSIGNAL | more;
+            }
+            break;
+        } else if (hasSpan) {
+            if (conn->chunk == NULL && (conn->chunk = malloc(URING_LOOP_FILE_CHUNK)) == NULL) {
+                close_connection(loop, conn);
+                return;
+            }
+            if ((sqe = queue_op(loop, conn, OP_READ_FILE, IORING_OP_READ,
+                                response->file->fd)) != NULL) {
+                sqe->addr = (uintptr_t)conn->chunk;
+                sqe->len = length < URING_LOOP_FILE_CHUNK ? length : URING_LOOP_FILE_CHUNK;
+                sqe->off = offset;
+            }
+            break;
+        }
+
+        // The whole response is out.
+        http_server_response_sent(conn);
+        if (!conn->keep_alive) {
+            close_connection(loop, conn);
+            return;
+        }
+        http_server_connection_reset(conn);
+    }
+
+    if (sqe == NULL) {
+        unlink_connection(loop, conn);
+        http_server_connection_destroy(conn);
+        return;
+    }
+    uint64_t now = timer_wheel_now_ms();
+    timer_wheel_schedule(&loop->wheel, &conn->timer,
+                         http_server_connection_deadline(conn, *loop->config, now));
+}
+
+/*
+Description:
+    Record the result of a connection's operation and queue its next one.
+Arguments:
+    UringLoop *loop: The loop that owns the connection.
+    Connection *conn: The connection the completion belongs to.
+    UringOp op: The operation that completed.
+    int result: The completion's result: a byte count, or a negative errno.
+Return value:
+    None
+*/
+static void complete_connection(UringLoop *loop, Connection *conn, UringOp op, int result) {
+    if (op == OP_CLOSE) {
+        http_server_connection_destroy(conn);
+        return;
+    }
+
+    if (result < 0 || (result == 0 && (op == OP_RECV || op == OP_READ_FILE)) || loop->stopping) {
+        if (result < 0 && result != -ECONNRESET && result != -EPIPE) {
+            log_error("io_uring op %d: %s", op, strerror(-result));
+        }
+        close_connection(loop, conn);
+        return;
+    }
+
+    switch (op) {
+    case OP_RECV:
+        conn->recv_len += result;
+        break;
+    case OP_SEND_HEAD: {
+        size_t headSent = (size_t)result < conn->send_len - conn->send_pos
+                              ? (size_t)result
+                              : conn->send_len - conn->send_pos;
+        conn->send_pos += headSent;
+        conn->body_sent += result - headSent;
+        break;
+    }
+    case OP_SEND_BODY:
+        // Either file bytes read into the chunk, or a body part that is in memory.
+        if (conn->chunk_pos < conn->chunk_len) {
+            conn->chunk_pos += result;
+        } else {
+            conn->body_sent += result;
+        }
+        break;
+    case OP_READ_FILE:
+        conn->chunk_len = result;
+        conn->chunk_pos = 0;
+        conn->body_sent += result;
+        break;
+    default:
+        break;
+    }
+    advance(loop, conn);
+}
+
+static void accept_client(UringLoop *loop, int result) {
+    if (result < 0) {
+        if (result != -ECANCELED && result != -EINTR) {
+            log_error("accept: %s", strerror(-result));
+        }
+    } else if (loop->stopping) {
+        close(result);
+    } else {
+        Connection *conn = http_server_connection_create(result);
+        if (conn == NULL) {
+            close(result);
+        } else {
+            conn->next = loop->connections;
+            if (loop->connections != NULL) {
+                loop->connections->prev = conn;
+            }
+            loop->connections = conn;
+            advance(loop, conn);
+        }
+    }
+
+    if (!loop->stopping) {
+        queue_accept(loop);
+    }
+}
+
+/*
+Description:
+    Shut down the socket of a connection that missed its deadline. That fails or ends the
+    operation it has in flight, and the connection is closed like any other disconnect when the
+    completion comes back.
+Arguments:
+    Timer *timer: The connection's expired timer.
+    void *arg: Unused.
+Return value:
+    None
+*/
+static void expire_connection(Timer *timer, void *arg) {
+    (void)arg;
+    log_info("Closing a connection that missed its deadline.");
+    shutdown(((Connection *)timer->data)->socket, SHUT_RDWR);
+}
+
+/*
+Description:
+    Runs every URING_LOOP_WAIT_MS. Expires connections that missed their deadline. Once *running
+    is false, shuts down every connection and cancels the pending accept so the loop drains.
+Arguments:
+    UringLoop *loop: The loop to check.
+Return value:
+    None
+*/
+static void tick(UringLoop *loop) {
+    timer_wheel_advance(&loop->wheel, timer_wheel_now_ms(), expire_connection, NULL);
+
+    if (!*loop->running) {
+        loop->stopping = true;
+        struct io_uring_sqe *sqe = queue_op(loop, NULL, OP_CANCEL, IORING_OP_ASYNC_CANCEL, -1);
+        if (sqe != NULL) {
+            sqe->addr = (uint64_t)OP_ACCEPT;
+        }
+    }
+
+    if (loop->stopping) {
+        for (Connection *conn = loop->connections; conn != NULL; conn = conn->next) {
+            shutdown(conn->socket, SHUT_RDWR);
+        }
+    } else {
+        queue_tick(loop);
+    }
+}
+
+static void reap_completions(UringLoop *loop) {
+    Ring *ring = &loop->ring;
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        UringOp op = (UringOp)(cqe->user_data & OP_MASK);
+        Connection *conn = (Connection *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+        int result = cqe->res;
+
+        loop->in_flight--;
+        if (op == OP_ACCEPT) {
+            accept_client(loop, result);
+        } else if (op == OP_TICK) {
+            tick(loop);
+        } else if (conn != NULL) {
+            complete_connection(loop, conn, op, result);
+        }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void *uring_loop_thread(void *arg) {
+    UringLoop *loop = (UringLoop *)arg;
+
+    queue_accept(loop);
+    queue_tick(loop);
+    // Every connection always has exactly one operation in flight, so once the accept is
+    // cancelled and the ticks stop, reaching zero means every connection has been closed.
+    while (loop->in_flight > 0) {
+        if (ring_enter(&loop->ring, true) == -1 && errno != EINTR && errno != EAGAIN &&
+            errno != EBUSY) {
+            log_error("io_uring_enter: %s", strerror(errno));
+            break;
+        }
+        reap_completions(loop);
+    }
+
+    ring_teardown(&loop->ring);
+    while (loop->connections != NULL) {
+        Connection *conn = loop->connections;
+        unlink_connection(loop, conn);
+        http_server_connection_destroy(conn);
+    }
+    return NULL;
+}
+
+/*
+Description:
+    Serve clients from the listening socket with config.num_threads io_uring rings, one per
+    thread. Accepts, receives, sends, file reads and closes are all queued on the ring and
+    submitted in one io_uring_enter(2) call per batch, which also reaps the completions of the
+    previous batch. Requests are parsed and answered with the same http_server_* functions as the
+    other modes. *This is a blocking call.*
+Arguments:
+    int socket: The bound server socket to listen and accept on.
+    Config config: The server configuration.
+    volatile bool *running: Checked every URING_LOOP_WAIT_MS; the rings drain and exit once it is
+        false.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+int uring_loop_run(int socket, Config config, volatile bool *running) {
+    int started = 0;
+
+    if (listen(socket, SOMAXCONN) == -1) {
+        log_error("listen: %s", strerror(errno));
+        return 1;
+    }
+
+    UringLoop *loops = calloc(config.num_threads, sizeof(UringLoop));
+    if (loops == NULL) {
+        return 1;
+    }
+
+    for (int i = 0; i < config.num_threads; i++) {
+        UringLoop *loop = &loops[i];
+        loop->listen_socket = socket;
+        loop->config = &config;
+        loop->running = running;
+        timer_wheel_init(&loop->wheel, timer_wheel_now_ms());
+
+        if (ring_setup(&loop->ring, URING_LOOP_ENTRIES) == 1) {
+            break;
+        }
+        if (pthread_create(&loop->thread, NULL, uring_loop_thread, loop) != 0) {
+            log_error("Could not start io_uring thread.");
+            ring_teardown(&loop->ring);
+            break;
+        }
+        started++;
+    }
+
+    if (started != config.num_threads) {
+        *running = false;
+    }
+    printf("server: %d io_uring rings waiting for connections...\n", started);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(loops[i].thread, NULL);
+    }
+    free(loops);
+
+    return started == config.num_threads ? 0 : 1;
+}
@@ -0,0 +1,30 @@
+#ifndef URING_LOOP_H_
+#define URING_LOOP_H_
+
+#include <stdbool.h>
+
+#include "http_server.h"
+
+#define URING_LOOP_ENTRIES 256
+#define URING_LOOP_WAIT_MS 500
+// Files that are not in the cache are read into a buffer this big and sent from there.
+#define URING_LOOP_FILE_CHUNK (64 * 1024)
+
+/*
+Description:
+    Serve clients from the listening socket with config.num_threads io_uring rings, one per
+    thread. Accepts, receives, sends, file reads and closes are all queued on the ring and
+    submitted in one io_uring_enter(2) call per batch, which also reaps the completions of the
+    previous batch. Requests are parsed and answered with the same http_server_* functions as the
+    other modes. *This is a blocking call.*
+Arguments:
+    int socket: The bound server socket to listen and accept on.
+    Config config: The server configuration.
+    volatile bool *running: Checked every URING_LOOP_WAIT_MS; the rings drain and exit once it is
+        false.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+int uring_loop_run(int socket, Config config, volatile bool *running);
+
+#endif
@@ -0,0 +1,676 @@
+// An HTTP/1.1 load generator for measuring the server locally:
+//
+//     bin/http_bench [-a ADDRESS] [-p PORT] [-c CONNECTIONS] [-t THREADS] [-d SECONDS]
+//                    [-P DEPTH] [-R RATE] [-n] [PATH...]
+//
+// Each thread drives its share of the connections from an epoll loop. By default the load is
+// closed-loop: every connection keeps DEPTH pipelined requests in flight and sends the next one
+// as soon as a response completes. With -R the load is open-loop: requests are due at a fixed
+// total rate whether or not the server keeps up, and a request's latency is measured from when
+// it was due rather than when a connection was free to send it, so a stalled server shows up in
+// the percentiles instead of just slowing the load down. -n closes the connection after every
+// response instead of keeping it alive. The paths are requested round robin.
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_DEPTH 64
+#define MAX_PATHS 64
+#define MAX_HEADER 16384
+#define RECV_BUFFER 65536
+#define MAX_EVENTS 256
+// Requests that came due in open-loop mode while every connection was busy.
+#define BACKLOG_SIZE (1 << 20)
+// Latencies are kept HDR style: 2^SUB_BUCKET_BITS linear buckets per power of two of
+// nanoseconds, so every recorded value is within 1% of the truth whatever its magnitude.
+#define SUB_BUCKET_BITS 7
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS)
+
+typedef struct Histogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+typedef struct BenchConnection {
+    int fd;
+    bool connected;
+    char out[MAX_DEPTH * 512]; // Requests not yet taken by the socket.
+    size_t out_len;
+    size_t out_pos;
+    char header[MAX_HEADER]; // The head of the response being received.
+    size_t header_len;
+    bool in_body;
+    uint64_t body_left;
+    int status;
+    bool close_after; // The response being received ends the connection.
+    // When each request in flight was sent, or came due in open-loop mode, oldest first.
+    uint64_t sent_at[MAX_DEPTH];
+    int first;
+    int in_flight;
+    uint64_t responses; // Since the connection was opened.
+} BenchConnection;
+
+typedef struct BenchThread {
+    pthread_t thread;
+    int epoll_fd;
+    BenchConnection *connections;
+    int num_connections;
+    int next_path;
+    uint64_t interval_ns; // Between requests coming due; 0 for closed-loop.
+    uint64_t next_due_ns;
+    uint64_t *backlog;
+    size_t backlog_first;
+    size_t backlog_len;
+
+    Histogram latency;
+    uint64_t responses;
+    uint64_t bytes;
+    uint64_t statuses[6]; // By class: 1xx to 5xx, and anything else.
+    uint64_t errors;
+    uint64_t resent;
+    uint64_t dropped;
+} BenchThread;
+
+static struct addrinfo *address;
+static const char *hostName = "127.0.0.1";
+static const char *paths[MAX_PATHS];
+static char *requests[MAX_PATHS];
+static size_t requestLengths[MAX_PATHS];
+static int numPaths = 0;
+static int depth = 1;
+static bool keepAlive = true;
+static volatile bool stopping = false;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static int bucket_index(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return (int)value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    return ((exponent - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS) +
+           (int)((value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+}
+
+// The middle of a bucket, which is what a percentile that falls in it is reported as.
+static uint64_t bucket_value(int index) {
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    int shift = (index >> SUB_BUCKET_BITS) - 1;
+    uint64_t low = (uint64_t)(SUB_BUCKETS + (index & (SUB_BUCKETS - 1))) << shift;
+    return low + (((uint64_t)1 << shift) >> 1);
+}
+
+static void histogram_record(Histogram *histogram, uint64_t value) {
+    histogram->counts[bucket_index(value)]++;
+    histogram->total++;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+static uint64_t histogram_percentile(const Histogram *histogram, double percentile) {
+    uint64_t rank = (uint64_t)(percentile / 100 * histogram->total + 0.5);
+    uint64_t seen = 0;
+
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+/*
+Description:
+    Start a non-blocking connect on a connection and register it with the thread's epoll set.
+Arguments:
+    BenchThread *thread: The thread that owns the connection.
+    BenchConnection *conn: The connection, closed.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+static int open_connection(BenchThread *thread, BenchConnection *conn) {
+    conn->fd = socket(address->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd == -1) {
+        return 1;
+    }
+    if (connect(conn->fd, address->ai_addr, address->ai_addrlen) == -1 &&
+        errno != EINPROGRESS) {
+        close(conn->fd);
+        conn->fd = -1;
+        return 1;
+    }
+    conn->connected = false;
+    conn->out_len = 0;
+    conn->out_pos = 0;
+    conn->header_len = 0;
+    conn->in_body = false;
+    conn->close_after = false;
+    conn->first = 0;
+    conn->in_flight = 0;
+    conn->responses = 0;
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = conn;
+    if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) == -1) {
+        close(conn->fd);
+        conn->fd = -1;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+Description:
+    Close a connection and open a new one in its place. Requests still in flight count as
+    errors, unless the server closed a connection it had been answering on: a server that caps
+    the requests per connection drops whatever was pipelined past the cap, so those are sent
+    again, open-loop ones with the time they first came due.
+Arguments:
+    BenchThread *thread: The thread that owns the connection.
+    BenchConnection *conn: The connection.
+    bool expected: Whether the server closed the connection in the normal course of things.
+Return value:
+    None
+*/
+static void reconnect(BenchThread *thread, BenchConnection *conn, bool expected) {
+    for (int i = 0; i < conn->in_flight; i++) {
+        uint64_t due = conn->sent_at[(conn->first + i) % MAX_DEPTH];
+        if (!expected) {
+            thread->errors++;
+            continue;
+        }
+        thread->resent++;
+        if (thread->interval_ns != 0 && thread->backlog_len < BACKLOG_SIZE) {
+            thread->backlog[(thread->backlog_first + thread->backlog_len++) % BACKLOG_SIZE] = due;
+        }
+    }
+    close(conn->fd);
+    conn->fd = -1;
+    if (!stopping && open_connection(thread, conn)) {
+        thread->errors++;
+    }
+}
+
+/*
+Description:
+    Send whatever of a connection's queued requests the socket will take.
+Arguments:
+    BenchConnection *conn: The connection.
+Return value:
+    Returns a 1 if the connection failed, 0 otherwise.
+*/
+static int flush(BenchConnection *conn) {
+    while (conn->out_pos < conn->out_len) {
+        ssize_t sent = send(conn->fd, conn->out + conn->out_pos, conn->out_len - conn->out_pos,
+                            MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (sent == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : 1;
+        }
+        conn->out_pos += sent;
+    }
+    conn->out_pos = 0;
+    conn->out_len = 0;
+    return 0;
+}
+
+/*
+Description:
+    Queue requests on a connection until it has DEPTH in flight or, in open-loop mode, until no
+    request is due, then send them.
+Arguments:
+    BenchThread *thread: The thread that owns the connection.
+    BenchConnection *conn: The connection.
+Return value:
+    Returns a 1 if the connection failed, 0 otherwise.
+*/
+static int fill(BenchThread *thread, BenchConnection *conn) {
+    int limit = keepAlive ? depth : 1;
+
+    if (!conn->connected || conn->close_after || stopping) {
+        return 0;
+    }
+    while (conn->in_flight < limit) {
+        uint64_t sentAt;
+        if (thread->interval_ns == 0) {
+            sentAt = now_ns();
+        } else if (thread->backlog_len > 0) {
+            sentAt = thread->backlog[thread->backlog_first];
+            thread->backlog_first = (thread->backlog_first + 1) % BACKLOG_SIZE;
+            thread->backlog_len--;
+        } else {
+            break;
+        }
+        int path = thread->next_path;
+        thread->next_path = (thread->next_path + 1) % numPaths;
+        if (conn->out_pos > 0) {
+            // Keep only what the socket has not taken yet, so the buffer never creeps forward.
+            memmove(conn->out, conn->out + conn->out_pos, conn->out_len - conn->out_pos);
+            conn->out_len -= conn->out_pos;
+            conn->out_pos = 0;
+        }
+        // Each request is at most 1/MAX_DEPTH of the buffer and at most depth are unanswered.
+        assert(conn->out_len + requestLengths[path] <= sizeof conn->out);
+        memcpy(conn->out + conn->out_len, requests[path], requestLengths[path]);
+        conn->out_len += requestLengths[path];
+        conn->sent_at[(conn->first + conn->in_flight) % MAX_DEPTH] = sentAt;
+        conn->in_flight++;
+    }
+    return flush(conn);
+}
+
+/*
+Description:
+    Read the status line and the headers the benchmark cares about out of a response head.
+Arguments:
+    BenchConnection *conn: The connection, with the whole head in conn->header.
+Return value:
+    None
+*/
+static void parse_head(BenchConnection *conn) {
+    conn->header[conn->header_len] = '\0';
+    conn->status = 0;
+    conn->body_left = 0;
+    sscanf(conn->header, "HTTP/%*d.%*d %d", &conn->status);
+
+    for (char *line = strstr(conn->header, "\r\n"); line != NULL;
+         line = strstr(line + 2, "\r\n")) {
+        char *field = line + 2;
+        if (strncasecmp(field, "Content-Length:", 15) == 0) {
+            conn->body_left = strtoull(field + 15, NULL, 10);
+        } else if (strncasecmp(field, "Connection:", 11) == 0 &&
+                   strncasecmp(field + 11 + strspn(field + 11, " "), "close", 5) == 0) {
+            conn->close_after = true;
+        }
+    }
+}
+
+/*
+Description:
+    Count a response that has been received in full and start on the next one.
+Arguments:
+    BenchThread *thread: The thread that owns the connection.
+    BenchConnection *conn: The connection.
+Return value:
+    None
+*/
+static void finish_response(BenchThread *thread, BenchConnection *conn) {
+    uint64_t sentAt = conn->sent_at[conn->first];
+    conn->first = (conn->first + 1) % MAX_DEPTH;
+    conn->in_flight--;
+    conn->responses++;
+
+    histogram_record(&thread->latency, now_ns() - sentAt);
+    thread->responses++;
+    thread->statuses[conn->status >= 100 && conn->status < 600 ? conn->status / 100 - 1 : 5]++;
+    conn->header_len = 0;
+    conn->in_body = false;
+}
+
+/*
+Description:
+    Read everything the socket has and pick the responses out of it.
+Arguments:
+    BenchThread *thread: The thread that owns the connection.
+    BenchConnection *conn: The connection.
+    char *buffer: Scratch space of RECV_BUFFER bytes.
+Return value:
+    Returns a 1 if the connection was closed, 0 otherwise.
+*/
+static int receive(BenchThread *thread, BenchConnection *conn, char *buffer) {
+    while (true) {
+        ssize_t received = recv(conn->fd, buffer, RECV_BUFFER, 0);
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (received <= 0) {
+            reconnect(thread, conn, conn->responses > 0);
+            return 1;
+        }
+        thread->bytes += received;
+
+        for (ssize_t pos = 0; pos < received;) {
+            if (conn->in_body) {
+                uint64_t available = received - pos;
+                uint64_t taken = conn->body_left < available ? conn->body_left : available;
+                conn->body_left -= taken;
+                pos += taken;
+            } else {
+                // Copy a byte at a time so the end of the head is found wherever reads split it.
+                if (conn->header_len == MAX_HEADER - 1) {
+                    thread->errors++;
+                    reconnect(thread, conn, false);
+                    return 1;
+                }
+                conn->header[conn->header_len++] = buffer[pos++];
+                if (conn->header_len < 4 ||
+                    memcmp(conn->header + conn->header_len - 4, "\r\n\r\n", 4) != 0) {
+                    continue;
+                }
+                parse_head(conn);
+                conn->in_body = true;
+            }
+            if (conn->in_body && conn->body_left == 0) {
+                if (conn->in_flight == 0) {
+                    // A response nobody asked for.
+                    thread->errors++;
+                    reconnect(thread, conn, false);
+                    return 1;
+                }
+                finish_response(thread, conn);
+                if (conn->close_after) {
+                    reconnect(thread, conn, true);
+                    return 1;
+                }
+            }
+        }
+        if (fill(thread, conn)) {
+            reconnect(thread, conn, conn->responses > 0);
+            return 1;
+        }
+    }
+}
+
+/*
+Description:
+    In open-loop mode, put the requests that have come due since the last call in the backlog,
+    and hand them out to connections with room for them.
+Arguments:
+    BenchThread *thread: The thread.
+Return value:
+    None
+*/
+static void schedule(BenchThread *thread) {
+    uint64_t now = now_ns();
+    bool due = false;
+
+    while (thread->next_due_ns <= now) {
+        if (thread->backlog_len < BACKLOG_SIZE) {
+            thread->backlog[(thread->backlog_first + thread->backlog_len++) % BACKLOG_SIZE] =
+                thread->next_due_ns;
+        } else {
+            thread->dropped++;
+        }
+        thread->next_due_ns += thread->interval_ns;
+        due = true;
+    }
+    for (int i = 0; due && i < thread->num_connections && thread->backlog_len > 0; i++) {
+        BenchConnection *conn = &thread->connections[i];
+        if (conn->fd != -1 && fill(thread, conn)) {
+            reconnect(thread, conn, conn->responses > 0);
+        }
+    }
+}
+
+static void *bench_thread(void *arg) {
+    BenchThread *thread = (BenchThread *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    char *buffer = malloc(RECV_BUFFER);
+
+    if (buffer == NULL) {
+        return NULL;
+    }
+    thread->next_due_ns = now_ns();
+    for (int i = 0; i < thread->num_connections; i++) {
+        if (open_connection(thread, &thread->connections[i])) {
+            thread->errors++;
+        }
+    }
+
+    while (!stopping) {
+        // Open-loop requests come due continuously, so don't sleep past the next one.
+        int timeout = thread->interval_ns != 0 ? 1 : 100;
+        int numEvents = epoll_wait(thread->epoll_fd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < numEvents; i++) {
+            BenchConnection *conn = (BenchConnection *)events[i].data.ptr;
+            if (conn->fd == -1) {
+                continue;
+            }
+            if (!conn->connected && (events[i].events & (EPOLLOUT | EPOLLERR))) {
+                int error = 0;
+                socklen_t length = sizeof error;
+                if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 ||
+                    error != 0) {
+                    reconnect(thread, conn, false);
+                    thread->errors++;
+                    continue;
+                }
+                conn->connected = true;
+            }
+            if ((events[i].events & EPOLLIN) && receive(thread, conn, buffer)) {
+                continue;
+            }
+            if ((events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) && fill(thread, conn)) {
+                reconnect(thread, conn, conn->responses > 0);
+            }
+        }
+        if (thread->interval_ns != 0) {
+            schedule(thread);
+        }
+    }
+
+    for (int i = 0; i < thread->num_connections; i++) {
+        if (thread->connections[i].fd != -1) {
+            close(thread->connections[i].fd);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-a ADDRESS] [-p PORT] [-c CONNECTIONS] [-t THREADS] [-d SECONDS]\n"
+            "       %*s [-P DEPTH] [-R RATE] [-n] [PATH...]\n",
+            name, (int)strlen(name), "");
+}
+
+int main(int argc, char *argv[]) {
+    const char *port = "8084";
+    int numConnections = 16;
+    int numThreads = 1;
+    int duration = 10;
+    double rate = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:p:c:t:d:P:R:nh")) != -1) {
+        switch (opt) {
+        case 'a':
+            hostName = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'c':
+            numConnections = atoi(optarg);
+            break;
+        case 't':
+            numThreads = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'P':
+            depth = atoi(optarg);
+            break;
+        case 'R':
+            rate = atof(optarg);
+            break;
+        case 'n':
+            keepAlive = false;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (numConnections < 1 || numThreads < 1 || duration < 1 || depth < 1 || depth > MAX_DEPTH ||
+        rate < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (numThreads > numConnections) {
+        numThreads = numConnections;
+    }
+    for (; optind < argc && numPaths < MAX_PATHS; optind++) {
+        paths[numPaths++] = argv[optind];
+    }
+    if (numPaths == 0) {
+        paths[numPaths++] = "/page.html";
+        paths[numPaths++] = "/style.css";
+        paths[numPaths++] = "/background.jpg";
+    }
+    for (int i = 0; i < numPaths; i++) {
+        if (asprintf(&requests[i], "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", paths[i], hostName,
+                     keepAlive ? "" : "Connection: close\r\n") == -1 ||
+            strlen(requests[i]) > sizeof(((BenchConnection *)0)->out) / MAX_DEPTH) {
+            fprintf(stderr, "http_bench: path too long: %s\n", paths[i]);
+            return 1;
+        }
+        requestLengths[i] = strlen(requests[i]);
+    }
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    int result = getaddrinfo(hostName, port, &hints, &address);
+    if (result != 0) {
+        fprintf(stderr, "http_bench: %s: %s\n", hostName, gai_strerror(result));
+        return 1;
+    }
+
+    BenchThread *threads = calloc(numThreads, sizeof(BenchThread));
+    if (threads == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < numThreads; i++) {
+        BenchThread *thread = &threads[i];
+        // Spread the connections, and in open-loop mode the rate, evenly over the threads.
+        thread->num_connections = numConnections / numThreads + (i < numConnections % numThreads);
+        thread->connections = calloc(thread->num_connections, sizeof(BenchConnection));
+        thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        thread->next_path = i % numPaths;
+        if (rate > 0) {
+            thread->interval_ns = (uint64_t)(1e9 * numThreads / rate);
+            thread->interval_ns = thread->interval_ns > 0 ? thread->interval_ns : 1;
+            thread->backlog = malloc(sizeof(uint64_t) * BACKLOG_SIZE);
+        }
+        if (thread->connections == NULL || thread->epoll_fd == -1 ||
+            (rate > 0 && thread->backlog == NULL)) {
+            fprintf(stderr, "http_bench: could not set up thread %d\n", i);
+            return 1;
+        }
+        for (int j = 0; j < thread->num_connections; j++) {
+            thread->connections[j].fd = -1;
+        }
+    }
+
+    printf("%d connections on %d threads, %s, depth %d, %s for %ds against %s:%s\n",
+           numConnections, numThreads, keepAlive ? "keep-alive" : "one request per connection",
+           keepAlive ? depth : 1, rate > 0 ? "open-loop" : "closed-loop", duration, hostName,
+           port);
+    uint64_t start = now_ns();
+    for (int i = 0; i < numThreads; i++) {
+        if (pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]) != 0) {
+            fprintf(stderr, "http_bench: could not start thread %d\n", i);
+            return 1;
+        }
+    }
+    sleep(duration);
+    stopping = true;
+
+    Histogram *latency = calloc(1, sizeof(Histogram));
+    uint64_t responses = 0, bytes = 0, errors = 0, resent = 0, dropped = 0, statuses[6] = {0};
+    if (latency == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < numThreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            latency->counts[b] += threads[i].latency.counts[b];
+        }
+        latency->total += threads[i].latency.total;
+        if (threads[i].latency.max > latency->max) {
+            latency->max = threads[i].latency.max;
+        }
+        responses += threads[i].responses;
+        bytes += threads[i].bytes;
+        errors += threads[i].errors;
+        resent += threads[i].resent;
+        dropped += threads[i].dropped;
+        for (int s = 0; s < 6; s++) {
+            statuses[s] += threads[i].statuses[s];
+        }
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    printf("%llu responses in %.2fs: %.0f requests/s, %.2f MB/s\n", (unsigned long long)responses,
+           seconds, responses / seconds, bytes / seconds / 1e6);
+    printf("status 1xx %llu, 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, other %llu; errors %llu",
+           (unsigned long long)statuses[0], (unsigned long long)statuses[1],
+           (unsigned long long)statuses[2], (unsigned long long)statuses[3],
+           (unsigned long long)statuses[4], (unsigned long long)statuses[5],
+           (unsigned long long)errors);
+    if (resent > 0) {
+        printf(", %llu resent after the server closed the connection",
+               (unsigned long long)resent);
+    }
+    if (dropped > 0) {
+        printf(", %llu not sent because the backlog was full", (unsigned long long)dropped);
+    }
+    printf("\n");
+    if (latency->total > 0) {
+        const double percentiles[] = {50, 90, 99, 99.9, 99.99};
+        printf("latency");
+        for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+            printf(" p%g %.3fms", percentiles[i],
+                   histogram_percentile(latency, percentiles[i]) / 1e6);
+        }
+        printf(" max %.3fms\n", latency->max / 1e6);
+    }
+    for (int i = 0; i < numThreads; i++) {
+        close(threads[i].epoll_fd);
+        free(threads[i].connections);
+        free(threads[i].backlog);
+    }
+    for (int i = 0; i < numPaths; i++) {
+        free(requests[i]);
+    }
+    free(threads);
+    free(latency);
+    freeaddrinfo(address);
+    return errors > 0;
+}
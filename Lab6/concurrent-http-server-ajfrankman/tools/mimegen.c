@@ -0,0 +1,208 @@
+// Turns a table of file extensions and their types into a header with a perfect hash table, so
+// the server finds the type of a file with one hash and one compare:
+//
+//     bin/mimegen tools/mime.types obj/mime_table.h
+//
+// Each line of the table is "extension compress type", where compress is yes or no and the type
+// is the rest of the line. Blank lines and lines starting with # are skipped.
+
+#include "../src/mime.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_TYPES 1024
+#define MAX_LINE 256
+// Seeds tried at one table size before the table is doubled.
+#define SEEDS_PER_SIZE 100000
+
+typedef struct Entry {
+    char *extension;
+    char *type;
+    int compressible;
+} Entry;
+
+static Entry entries[MAX_TYPES];
+static int numEntries = 0;
+
+/*
+Description:
+    Read the table of types.
+Arguments:
+    const char *path: The table to read.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+static int read_table(const char *path) {
+    char line[MAX_LINE];
+    char extension[MAX_LINE];
+    char compress[MAX_LINE];
+    int lineNumber = 0;
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+    while (fgets(line, sizeof line, file) != NULL) {
+        lineNumber++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char *start = line + strspn(line, " \t");
+        if (*start == '\0' || *start == '#') {
+            continue;
+        }
+
+        int typeOffset;
+        if (sscanf(start, "%s %s %n", extension, compress, &typeOffset) != 2 ||
+            start[typeOffset] == '\0' ||
+            (strcmp(compress, "yes") != 0 && strcmp(compress, "no") != 0)) {
+            fprintf(stderr, "%s:%d: expected \"extension yes|no type\"\n", path, lineNumber);
+            fclose(file);
+            return 1;
+        }
+        for (char *c = extension; *c != '\0'; c++) {
+            if (isupper((unsigned char)*c) || *c == '.' || *c == '/') {
+                fprintf(stderr, "%s:%d: extensions are lower case, without a dot\n", path,
+                        lineNumber);
+                fclose(file);
+                return 1;
+            }
+        }
+        for (int i = 0; i < numEntries; i++) {
+            if (strcmp(entries[i].extension, extension) == 0) {
+                fprintf(stderr, "%s:%d: %s listed twice\n", path, lineNumber, extension);
+                fclose(file);
+                return 1;
+            }
+        }
+        if (numEntries == MAX_TYPES) {
+            fprintf(stderr, "%s: more than %d types\n", path, MAX_TYPES);
+            fclose(file);
+            return 1;
+        }
+        entries[numEntries].extension = strdup(extension);
+        entries[numEntries].type = strdup(start + typeOffset);
+        entries[numEntries].compressible = strcmp(compress, "yes") == 0;
+        numEntries++;
+    }
+    fclose(file);
+    return 0;
+}
+
+/*
+Description:
+    Find a table size and seed under which no two extensions share a slot.
+Arguments:
+    uint32_t *size: Set to the table size.
+    uint32_t *seed: Set to the seed.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+static int find_seed(uint32_t *size, uint32_t *seed) {
+    // Start at twice as many slots as extensions, where collision free seeds are plentiful.
+    for (*size = 2 * numEntries > 8 ? 2 * numEntries : 8; *size <= 1u << 20; *size *= 2) {
+        char *used = malloc(*size);
+        if (used == NULL) {
+            return 1;
+        }
+        for (*seed = 1; *seed <= SEEDS_PER_SIZE; (*seed)++) {
+            int i;
+            memset(used, 0, *size);
+            for (i = 0; i < numEntries; i++) {
+                const char *extension = entries[i].extension;
+                uint32_t slot = mime_hash(extension, strlen(extension), *seed) % *size;
+                if (used[slot]) {
+                    break;
+                }
+                used[slot] = 1;
+            }
+            if (i == numEntries) {
+                free(used);
+                return 0;
+            }
+        }
+        free(used);
+    }
+    return 1;
+}
+
+static void write_string(FILE *out, const char *string) {
+    fputc('"', out);
+    for (; *string != '\0'; string++) {
+        if (*string == '"' || *string == '\\') {
+            fputc('\\', out);
+        }
+        fputc(*string, out);
+    }
+    fputc('"', out);
+}
+
+/*
+Description:
+    Write the header, through a temporary file so a failed run leaves no half written table.
+Arguments:
+    const char *path: The header to write.
+    const char *source: The table it was generated from, for the comment at the top.
+    uint32_t size: The table size.
+    uint32_t seed: The seed.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+static int write_header(const char *path, const char *source, uint32_t size, uint32_t seed) {
+    char tmpPath[strlen(path) + 5];
+    size_t maxExtension = 0;
+
+    sprintf(tmpPath, "%s.tmp", path);
+    FILE *out = fopen(tmpPath, "w");
+    if (out == NULL) {
+        perror(tmpPath);
+        return 1;
+    }
+    for (int i = 0; i < numEntries; i++) {
+        if (strlen(entries[i].extension) > maxExtension) {
+            maxExtension = strlen(entries[i].extension);
+        }
+    }
+
+    fprintf(out, "// Generated by tools/mimegen.c from %s. Do not edit.\n\n", source);
+    fprintf(out, "#define MIME_TABLE_SIZE %uu\n", size);
+    fprintf(out, "#define MIME_TABLE_SEED %uu\n", seed);
+    fprintf(out, "#define MIME_TABLE_MAX_EXTENSION %zu\n\n", maxExtension);
+    fprintf(out, "static const MimeType mimeTable[MIME_TABLE_SIZE] = {\n");
+    for (int i = 0; i < numEntries; i++) {
+        const char *extension = entries[i].extension;
+        fprintf(out, "    [%u] = {", mime_hash(extension, strlen(extension), seed) % size);
+        write_string(out, extension);
+        fputs(", ", out);
+        write_string(out, entries[i].type);
+        fprintf(out, ", %s},\n", entries[i].compressible ? "true" : "false");
+    }
+    fprintf(out, "};\n");
+
+    if (fclose(out) != 0 || rename(tmpPath, path) != 0) {
+        perror(path);
+        remove(tmpPath);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t size;
+    uint32_t seed;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s TABLE HEADER\n", argv[0]);
+        return 1;
+    }
+    if (read_table(argv[1])) {
+        return 1;
+    }
+    if (find_seed(&size, &seed)) {
+        fprintf(stderr, "mimegen: no collision free seed for %d types\n", numEntries);
+        return 1;
+    }
+    return write_header(argv[2], argv[1], size, seed);
+}
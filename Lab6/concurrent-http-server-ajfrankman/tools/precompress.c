@@ -0,0 +1,229 @@
+// Writes .gz and .br variants next to the compressible files of a served folder, for the server
+// to send to clients that accept them:
+//
+//     bin/precompress [-f] [folder]
+//
+// Only the types tools/mime.types marks compressible are compressed, the same ones the server
+// gzips on the fly, and a variant is only kept if it is smaller than the file.
+// Variants that are already newer than their file are left alone unless -f is given.
+
+#define _XOPEN_SOURCE 700
+
+#include "mime.h"
+
+#include <brotli/encode.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// Smaller files gain less from compression than the response headers it adds cost.
+#define PRECOMPRESS_MIN_SIZE 256
+
+static bool force = false;
+static int failures = 0;
+
+/*
+Description:
+    Compress a buffer in the gzip format at the highest level.
+Arguments:
+    const char *data: The data to compress.
+    size_t size: The length of data.
+    size_t *compressed_size: Set to the length of the result.
+Return value:
+    Returns the compressed data, which must be freed, or NULL on failure.
+*/
+static char *gzip_compress(const char *data, size_t size, size_t *compressed_size) {
+    z_stream stream = {0};
+    // 16 added to the window bits asks for a gzip header and trailer instead of zlib's.
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) !=
+        Z_OK) {
+        return NULL;
+    }
+
+    size_t bound = deflateBound(&stream, size);
+    char *out = malloc(bound);
+    if (out == NULL) {
+        deflateEnd(&stream);
+        return NULL;
+    }
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = size;
+    stream.next_out = (Bytef *)out;
+    stream.avail_out = bound;
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&stream);
+        free(out);
+        return NULL;
+    }
+    *compressed_size = stream.total_out;
+    deflateEnd(&stream);
+    return out;
+}
+
+/*
+Description:
+    Compress a buffer in the brotli format at the highest quality.
+Arguments:
+    const char *data: The data to compress.
+    size_t size: The length of data.
+    size_t *compressed_size: Set to the length of the result.
+Return value:
+    Returns the compressed data, which must be freed, or NULL on failure.
+*/
+static char *brotli_compress(const char *data, size_t size, size_t *compressed_size) {
+    size_t bound = BrotliEncoderMaxCompressedSize(size);
+    char *out = malloc(bound);
+    if (out == NULL) {
+        return NULL;
+    }
+    *compressed_size = bound;
+    if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, size,
+                               (const uint8_t *)data, compressed_size, (uint8_t *)out)) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+/*
+Description:
+    Write a file through a temporary name and rename it into place, so the server never opens a
+    half written variant.
+Arguments:
+    const char *path: The file to write.
+    const char *data: The contents.
+    size_t size: The length of data.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+static int write_atomically(const char *path, const char *data, size_t size) {
+    char tmpPath[strlen(path) + 8];
+    sprintf(tmpPath, "%s.XXXXXX", path);
+
+    int fd = mkstemp(tmpPath);
+    if (fd == -1) {
+        return 1;
+    }
+    size_t written = 0;
+    while (written < size) {
+        ssize_t result = write(fd, data + written, size - written);
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result == -1) {
+            close(fd);
+            unlink(tmpPath);
+            return 1;
+        }
+        written += result;
+    }
+    if (fchmod(fd, 0644) == -1 || close(fd) == -1 || rename(tmpPath, path) == -1) {
+        unlink(tmpPath);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+Description:
+    Write one compressed variant of a file, unless an up to date one exists already or the
+    compressed data would not be smaller.
+Arguments:
+    const char *path: The original file.
+    const struct stat *info: What stat(2) said about it.
+    const char *data: Its contents.
+    const char *suffix: The variant's suffix, ".gz" or ".br".
+    char *(*compress)(const char *, size_t, size_t *): The compressor to use.
+Return value:
+    Returns a 1 on failure, 0 on success.
+*/
+static int write_variant(const char *path, const struct stat *info, const char *data,
+                         const char *suffix, char *(*compress)(const char *, size_t, size_t *)) {
+    char variantPath[strlen(path) + strlen(suffix) + 1];
+    struct stat variantInfo;
+    sprintf(variantPath, "%s%s", path, suffix);
+
+    if (!force && stat(variantPath, &variantInfo) == 0 &&
+        variantInfo.st_mtime >= info->st_mtime) {
+        return 0;
+    }
+
+    size_t compressedSize;
+    char *compressed = compress(data, info->st_size, &compressedSize);
+    if (compressed == NULL) {
+        fprintf(stderr, "precompress: could not compress %s\n", path);
+        return 1;
+    }
+    if (compressedSize >= (size_t)info->st_size) {
+        free(compressed);
+        unlink(variantPath);
+        printf("%s: not smaller, skipped\n", variantPath);
+        return 0;
+    }
+
+    int result = write_atomically(variantPath, compressed, compressedSize);
+    if (result) {
+        fprintf(stderr, "precompress: could not write %s: %s\n", variantPath, strerror(errno));
+    } else {
+        printf("%s: %lld -> %zu bytes\n", variantPath, (long long)info->st_size, compressedSize);
+    }
+    free(compressed);
+    return result;
+}
+
+static int visit(const char *path, const struct stat *info, int type, struct FTW *ftw) {
+    (void)ftw;
+    if (type != FTW_F || !S_ISREG(info->st_mode) || !mime_lookup(path)->compressible ||
+        info->st_size < PRECOMPRESS_MIN_SIZE) {
+        return 0;
+    }
+
+    FILE *file = fopen(path, "rb");
+    char *data = malloc(info->st_size);
+    if (file == NULL || data == NULL ||
+        fread(data, 1, info->st_size, file) != (size_t)info->st_size) {
+        fprintf(stderr, "precompress: could not read %s\n", path);
+        failures++;
+    } else {
+        failures += write_variant(path, info, data, ".gz", gzip_compress);
+        failures += write_variant(path, info, data, ".br", brotli_compress);
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+    free(data);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *folder = "www";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "fh")) != -1) {
+        switch (opt) {
+        case 'f':
+            force = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-f] [folder]\n", argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind < argc) {
+        folder = argv[optind];
+    }
+
+    // FTW_PHYS: don't follow links out of the folder.
+    if (nftw(folder, visit, 16, FTW_PHYS) == -1) {
+        fprintf(stderr, "precompress: could not walk %s: %s\n", folder, strerror(errno));
+        return 1;
+    }
+    return failures > 0;
+}